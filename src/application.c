@@ -308,20 +308,41 @@ static void config_apply(Application *app)
     {
         gboolean listen = TRUE;
         g_autoptr(DhtKey) key = NULL;
-        g_object_get(app->client, "key", &key, "listen", &listen, NULL);
+        g_autofree gchar *cache_file = NULL;
+        gboolean cookies = FALSE;
+        g_object_get(app->client, "key", &key, "listen", &listen, "cache-file", &cache_file, "cookies", &cookies, NULL);
         DhtClient *client = dht_client_new(key);
 
         g_autoptr(GInetAddress) inaddr_any = g_inet_address_new_any(DHT_ADDRESS_FAMILY);
         g_autoptr(GSocketAddress) address = g_inet_socket_address_new(inaddr_any, local_port);
         if(dht_client_bind(client, address, FALSE, &error))
         {
-            g_object_set(client, "listen", listen, NULL);
+            g_object_set(client, "listen", listen, "cookies", cookies, NULL);
+
+            // Keep tunables when the client is rebound
+            const gchar *const *name;
+            for(name = dht_client_tunables; *name; name++)
+            {
+                GValue value = G_VALUE_INIT;
+                g_value_init(&value, G_TYPE_UINT);
+                g_object_get_property(G_OBJECT(app->client), *name, &value);
+                g_object_set_property(G_OBJECT(client), *name, &value);
+                g_value_unset(&value);
+            }
+
             g_signal_connect_swapped(client, "new-connection", (GCallback)new_connection, app);
             g_object_bind_property(client, "peers", app->label_peers, "label", G_BINDING_SYNC_CREATE);
 
             g_object_unref(app->client);
             app->client = client;
 
+            // Restore nodes saved by the previous client
+            if(cache_file)
+            {
+                g_object_set(client, "cache-file", cache_file, NULL);
+                dht_client_load_nodes(client, cache_file, NULL);
+            }
+
             need_bootstrap = TRUE;
             g_key_file_set_integer(app->config, "network", "local-port", local_port);
         }
@@ -666,7 +687,7 @@ void application_run(DhtClient *client, GKeyFile *config)
     g_hash_table_destroy(app->id2alias_table);
 
     g_key_file_unref(config);
-    g_object_unref(client);
+    g_object_unref(app->client);
 }
 
 void application_init(gint argc, gchar *argv[])
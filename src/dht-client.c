@@ -14,25 +14,66 @@
 
 #define G_LOG_DOMAIN "DHT"
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include <glib/gi18n.h>
 #include "dht-client.h"
-
-#define DHT_NODE_COUNT 16 // number of nodes per bucket
-#define DHT_CONCURRENCY 3 // number of concurrent requests per lookup
-
-#define DHT_TIMEOUT_MS 1000 // request timeout (1 second)
-#define DHT_REFRESH_MS 60000 // refresh period (1 minute)
-#define DHT_LINGER_US 3600000000LL // dead node linger (1 hour)
+#include "dht-timer.h"
+
+#define DHT_NODE_COUNT 16 // default number of nodes per bucket
+#define DHT_NODE_COUNT_MAX 32 // maximum number of nodes per bucket, a full response still fits the MTU
+#define DHT_BUCKET_COUNT (DHT_ID_SIZE * 8) // maximum number of prefix lengths in the table
+#define DHT_SYMBOL_BITS_MAX 4 // maximum number of ID bits resolved per routing step
+#define DHT_REPLACEMENT_COUNT 8 // default number of replacement nodes per bucket
+#define DHT_REPLACEMENT_COUNT_MAX 32 // maximum number of replacement nodes per bucket
+#define DHT_CONCURRENCY 3 // initial number of concurrent requests per lookup
+#define DHT_CONCURRENCY_MIN 2 // default lower bound of adaptive concurrency
+#define DHT_CONCURRENCY_MAX 8 // default upper bound of adaptive concurrency
+#define DHT_SHORTLIST_COUNT 64 // maximum number of candidate nodes per lookup
+#define DHT_SEEN_BITS 7 // log2 of the candidate address index size per lookup
+#define DHT_BURST_COUNT (DHT_SHORTLIST_COUNT / 2) // maximum number of concurrent requests when restoring nodes, leaves room for closer nodes
+#define DHT_HEDGE_COUNT 3 // maximum number of hedged requests per lookup
+#define DHT_RTT_SAMPLES 64 // number of recent round-trip times for the hedging percentile
+#define DHT_PEER_COUNT 256 // number of recently resolved peer addresses
+#define DHT_SOURCE_BITS 10 // log2 of rate limited request sources
+#define DHT_SOURCE_RATE 20 // requests per second allowed from one source
+#define DHT_SOURCE_BURST 40 // requests allowed from one source at once
+#define DHT_HANDSHAKE_RATE 200 // handshakes per second over all sources
+#define DHT_HANDSHAKE_BURST 50 // handshakes allowed at once
+
+#define DHT_TIMEOUT_MS 1000 // default request timeout and handshake timeout (1 second)
+#define DHT_TIMEOUT_MIN_MS 100 // minimum adaptive request timeout (100 milliseconds)
+#define DHT_REFRESH_MS 60000 // default refresh period (1 minute)
+#define DHT_REFRESH_IDLE_US 900000000LL // bucket refresh after inactivity (15 minutes)
+#define DHT_LINGER_US 3600000000LL // default dead node linger (1 hour)
+#define DHT_SWEEP_MS 10000 // dead node eviction period (10 seconds)
+#define DHT_PEER_TTL_US 600000000LL // resolved peer address lifetime (10 minutes)
+#define DHT_INBOX_COUNT 1024 // maximum number of packets queued by workers for the main thread
+#define DHT_SNAPSHOT_MS 100 // routing table publish period for worker threads (100 milliseconds)
+#define DHT_COOKIE_MS 120000 // handshake cookie secret rotation period (2 minutes)
+#define DHT_CRYPTO_THREADS 2 // threads computing shared secrets for incoming connections
+#define DHT_CRYPTO_PENDING 64 // maximum number of queued key exchanges
+#define DHT_CONNECTION_RETRIES 2 // connection request resends before giving up
+#define DHT_PROBE_WINDOW 8 // concurrent lookups per probe
+#define DHT_FILL_BUDGET 1000 // default number of requests allowed for filling the table after bootstrap
+#define DHT_FILL_ROUND_MS 2000 // table filling round period (2 seconds)
 
 #define MSG_MTU 1500 // message buffer size
+#define MSG_BATCH_COUNT 32 // maximum number of messages received per wakeup or sent per flush
 
 enum
 {
     MSG_LOOKUP_REQ = 0xC0,
     MSG_LOOKUP_RES = 0xC1,
     MSG_CONNECTION_REQ = 0xC2,
-    MSG_CONNECTION_RES = 0xC3
+    MSG_CONNECTION_RES = 0xC3,
+    MSG_CONNECTION_COOKIE = 0xC4
 };
 
 enum
@@ -42,6 +83,20 @@ enum
     PROP_ID,
     PROP_PEERS,
     PROP_LISTEN,
+    PROP_CACHE_FILE,
+    PROP_MIN_CONCURRENCY,
+    PROP_MAX_CONCURRENCY,
+    PROP_COOKIES,
+    PROP_FILL_BUDGET,
+    PROP_SYMBOL_BITS,
+    PROP_NODE_COUNT,
+    PROP_REPLACEMENT_COUNT,
+    PROP_CONCURRENCY,
+    PROP_TIMEOUT,
+    PROP_REFRESH_INTERVAL,
+    PROP_REFRESH_IDLE,
+    PROP_LINGER,
+    PROP_SOCKET_BUFFER,
     PROP_LAST
 };
 
@@ -56,11 +111,21 @@ typedef struct _msg_lookup MsgLookup;
 typedef struct _msg_connection1 MsgConnection1;
 typedef struct _msg_connection2 MsgConnection2;
 typedef struct _msg_connection3 MsgConnection3;
+typedef struct _msg_cookie MsgCookie;
 
 typedef struct _dht_node DhtNode;
+typedef struct _dht_bucket DhtBucket;
+typedef struct _dht_peer DhtPeer;
+typedef struct _dht_packet DhtPacket;
+typedef struct _dht_source DhtSource;
+typedef struct _dht_receiver DhtReceiver;
+typedef struct _dht_snapshot DhtSnapshot;
+typedef struct _dht_worker DhtWorker;
 typedef struct _dht_query DhtQuery;
 typedef struct _dht_lookup DhtLookup;
 typedef struct _dht_connection DhtConnection;
+typedef struct _dht_handshake DhtHandshake;
+typedef struct _dht_probe DhtProbe;
 typedef struct _dht_client_private DhtClientPrivate;
 
 struct _msg_node
@@ -74,7 +139,7 @@ struct _msg_lookup
     guint8 type; // MSG_LOOKUP_REQ, MSG_LOOKUP_RES
     DhtId srcid;
     DhtId dstid;
-    MsgNode nodes[0]; // up to DHT_NODE_COUNT
+    MsgNode nodes[0]; // up to the responder's node count
 };
 
 struct _msg_connection1
@@ -82,6 +147,7 @@ struct _msg_connection1
     guint8 type; // MSG_CONNECTION_REQ
     DhtKey pubkey;
     DhtKey nonce;
+    guint8 cookie[0]; // optional, DHT_COOKIE_SIZE
 };
 
 struct _msg_connection2
@@ -100,21 +166,98 @@ struct _msg_connection3
     DhtKey auth_tag;
 };
 
+struct _msg_cookie
+{
+    guint8 type; // MSG_CONNECTION_COOKIE
+    DhtKey peer_nonce;
+    guint8 cookie[DHT_COOKIE_SIZE];
+};
+
 struct _dht_node
 {
     DhtId id;
     DhtAddress addr;
     gint64 timestamp;
+    gint64 srtt, rttvar; // zero if not measured
     gboolean is_alive;
 };
 
+struct _dht_bucket
+{
+    DhtNode *nodes; // node count slots in the table storage
+    guint num_nodes;
+
+    DhtNode *replacements; // replacement count slots, most recent first
+    guint num_replacements;
+
+    gint64 timestamp; // last lookup or response in range
+};
+
+struct _dht_peer
+{
+    DhtId id;
+    DhtAddress addr;
+    gint64 timestamp;
+};
+
+struct _dht_packet
+{
+    DhtAddress addr;
+    gsize len;
+    guint8 data[MSG_MTU];
+};
+
+struct _dht_source
+{
+    DhtAddress addr;
+    gint64 deadline; // when the token bucket is full again
+};
+
+struct _dht_receiver
+{
+    guint8 buffers[MSG_BATCH_COUNT][MSG_MTU];
+    DhtAddress addrs[MSG_BATCH_COUNT];
+    gssize lens[MSG_BATCH_COUNT]; // negative if the source address is not supported
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr messages[MSG_BATCH_COUNT];
+    struct iovec vectors[MSG_BATCH_COUNT];
+    struct sockaddr_storage natives[MSG_BATCH_COUNT];
+#endif /* HAVE_RECVMMSG */
+};
+
+struct _dht_snapshot
+{
+    gint ref_count;
+    guint num_buckets;
+    guint symbol_bits;
+    guint node_count;
+    gint64 linger_us;
+    DhtBucket buckets[0]; // immutable copy of the routing table, followed by its nodes
+};
+
+struct _dht_worker
+{
+    GSocket *socket; // shares the client port
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread; // nullable
+    DhtReceiver *receiver;
+    DhtSource *sources; // 1 << DHT_SOURCE_BITS, sources are pinned to one socket by the kernel
+    gint requests_dropped; // atomic
+    gint inbox_dropped; // atomic
+
+    DhtClient *client; // weak
+};
+
 struct _dht_query
 {
     DhtId metric;
     DhtAddress addr;
 
-    guint timeout_source;
-    gboolean is_finished, is_alive;
+    gint64 timestamp;
+    DhtTimer timer;
+    guint timeout_remaining;
+    gboolean is_finished, is_alive, is_hedged;
 
     DhtLookup *lookup; // weak
 };
@@ -123,11 +266,33 @@ struct _dht_lookup
 {
     DhtId id;
 
-    GSequence *query_sequence; // <DhtQuery>
-    GHashTable *query_table; // <DhtAddress, GSequenceIter>
-    guint num_sources;
+    DhtQuery queries[DHT_SHORTLIST_COUNT]; // never moved, timers are linked in place
+    guint8 order[DHT_SHORTLIST_COUNT]; // query indices sorted by metric
+    guint8 seen[1 << DHT_SEEN_BITS]; // open-addressed by address, query index + 1 or zero
+    guint num_candidates;
+
+    guint num_sources, concurrency;
+    guint num_hedged, num_hedges; // in flight, total
+    guint num_queries, num_timeouts, max_concurrency; // statistics
+    gboolean is_filling; // queries are charged against the fill budget
 
     GSList *results; // <GSimpleAsyncResult>
+    GSList *probes; // <DhtProbe>, weak
+    DhtClient *client; // weak
+};
+
+struct _dht_probe
+{
+    DhtId *targets; // sorted, started in order
+    guint num_targets, next_target;
+    guint num_pending, num_found;
+    GSList *lookups; // <DhtLookup>, weak, at most DHT_PROBE_WINDOW
+    gboolean is_starting;
+    guint start_source; // idle source starting the probe, zero once started
+
+    DhtProbeCallback progress;
+    gpointer progress_data;
+    GSimpleAsyncResult *result;
     DhtClient *client; // weak
 };
 
@@ -137,13 +302,29 @@ struct _dht_connection
     DhtKey nonce;
 
     gboolean is_remote;
-    guint timeout_source;
+    DhtTimer timer;
 
     GSocket *socket; // nullable
     GSocketAddress *sockaddr; // nullable
     GSimpleAsyncResult *result; // nullable
     DhtKey enc_key, dec_key, auth_tag;
 
+    guint8 cookie[DHT_COOKIE_SIZE]; // valid if has_cookie
+    gboolean has_cookie;
+    guint num_retries; // request resends
+
+    DhtClient *client; // weak
+};
+
+struct _dht_handshake
+{
+    DhtId id;
+    DhtAddress addr;
+    DhtKey pubkey, peer_nonce;
+    DhtKey shared; // valid if is_valid
+    gboolean is_valid;
+    gint64 elapsed; // time spent on key exchange
+
     DhtClient *client; // weak
 };
 
@@ -151,21 +332,86 @@ struct _dht_client_private
 {
     DhtId id;
     DhtKey pubkey, privkey;
+    DhtKeyCache *key_cache;
 
-    GList *buckets; // <GList<DhtNode>>
+    DhtBucket *buckets; // indexed by prefix length, then by the symbol following it
+    DhtNode *storage; // nodes and replacements of the buckets in use, grows with the table
     GHashTable *lookup_table; // <DhtId, DhtLookup>
     GHashTable *connection_table; // <DhtKey, DhtConnection>
+    GHashTable *peer_table; // <DhtId, GList>
+    GSList *probes; // <DhtProbe>
+    GQueue *peer_queue; // <DhtPeer>, most recent first
 
     gboolean listen;
-    guint num_buckets;
+    gboolean cookies;
+    DhtKey cookie_secrets[2]; // current, previous
+    gchar *cache_file; // nullable
+    guint min_concurrency, max_concurrency;
+    guint fill_budget;
+    guint node_count, replacement_count;
+    guint concurrency; // initial per lookup
+    guint timeout_ms, refresh_ms;
+    gint64 refresh_idle_us, linger_us;
+    guint socket_buffer; // zero for system default
+    DhtClientStats stats;
+    guint num_buckets; // prefix lengths in use, the last one covers all longer prefixes
+    guint symbol_bits;
     guint num_peers;
 
+    gint64 rtt_samples[DHT_RTT_SAMPLES];
+    guint num_rtt_samples;
+    guint hedge_delay; // zero if not computed
+
     GSocket *socket;
     guint socket_source;
-    guint timeout_source;
+    guint notify_source;
+
+    DhtReceiver *receiver; // reused on each wakeup
+    DhtSource *sources; // 1 << DHT_SOURCE_BITS, indexed by address hash
+    gint64 handshake_deadline;
+
+    DhtPacket *send_packets; // MSG_BATCH_COUNT queued datagrams, flushed before returning to the main loop
+    guint num_send_packets;
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr send_messages[MSG_BATCH_COUNT];
+    struct iovec send_vectors[MSG_BATCH_COUNT];
+    struct sockaddr_storage send_addresses[MSG_BATCH_COUNT];
+#endif /* HAVE_SENDMMSG */
+
+    DhtTimerWheel *timer_wheel;
+    DhtTimer refresh_timer;
+    DhtTimer sweep_timer;
+    DhtTimer cookie_timer;
+
+    DhtTimer fill_timer;
+    gboolean is_filling, is_filled;
+    gint64 fill_timestamp; // start of the filling phase
+    gint64 save_timestamp; // last node cache save
+    GBytes *saved_nodes; // nullable, node cache contents last loaded or saved
+    GCancellable *save_cancellable; // periodic saves in progress
+    guint fill_requests; // requests sent by filling lookups, charged against the budget
+    guint fill_peers; // number of peers after the previous round
+
+    GThreadPool *crypto_pool; // <DhtHandshake>
+    GAsyncQueue *handshakes; // <DhtHandshake>, completed by crypto_pool
+    guint num_handshakes; // queued or completed, not yet accepted
+
+    GSList *workers; // <DhtWorker>
+    GAsyncQueue *inbox; // <DhtPacket>, forwarded by workers
+    GSource *inbox_source; // drains inbox and handshakes
+    DhtSnapshot *snapshot; // nullable, guarded by snapshot_mutex
+    GMutex snapshot_mutex;
+    gboolean snapshot_dirty;
+    DhtTimer snapshot_timer;
 };
 
 static GParamSpec *dht_client_properties[PROP_LAST];
+
+const gchar *const dht_client_tunables[] =
+{
+    "min-concurrency", "max-concurrency", "fill-budget", "symbol-bits", "node-count", "replacement-count",
+    "concurrency", "timeout", "refresh-interval", "refresh-idle", "linger", "socket-buffer", NULL
+};
 static guint dht_client_signals[SIGNAL_LAST];
 
 G_DEFINE_TYPE_WITH_PRIVATE(DhtClient, dht_client, G_TYPE_OBJECT)
@@ -174,23 +420,97 @@ static void dht_client_set_property(GObject *obj, guint prop_id, const GValue *v
 static void dht_client_get_property(GObject *obj, guint prop_id, GValue *value, GParamSpec *pspec);
 static void dht_client_finalize(GObject *obj);
 
-static void dht_client_update(DhtClient *client, const DhtId *id, const DhtAddress *addr, gboolean is_alive);
+static void dht_client_update(DhtClient *client, const DhtId *id, const DhtAddress *addr, gboolean is_alive, gint64 rtt);
+static DhtNode* dht_client_find(DhtClient *client, const DhtId *id);
+static guint dht_client_timeout(DhtClient *client, const DhtId *id);
+static void dht_node_sample_rtt(DhtNode *node, gint64 rtt);
+static void dht_client_sample_rtt(DhtClient *client, gint64 rtt);
+static guint dht_client_hedge_delay(DhtClient *client);
+static void dht_client_merge(DhtClient *client);
+static void dht_client_send(DhtClient *client, const DhtAddress *addr, gconstpointer data, gsize len);
+static void dht_client_flush(DhtClient *client);
+static void dht_client_connect(DhtClient *client, const DhtId *id, const DhtAddress *addr, GSimpleAsyncResult *result);
+static void dht_client_accept(DhtClient *client, const DhtId *id, const DhtAddress *addr, const DhtKey *peer_nonce, const DhtKey *shared);
+static void dht_client_offload(DhtClient *client, const DhtId *id, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *peer_nonce);
+static void dht_client_remember_peer(DhtClient *client, const DhtId *id, const DhtAddress *addr);
+static const DhtAddress* dht_client_find_peer(DhtClient *client, const DhtId *id);
+static void dht_client_forget_peer(DhtClient *client, const DhtId *id);
+static DhtLookup* dht_lookup_new(DhtClient *client, const DhtId *id);
 static guint dht_client_search(DhtClient *client, const DhtId *id, MsgNode *nodes);
+static guint dht_table_search(const DhtBucket *buckets, guint num_buckets, guint symbol_bits, guint node_count, gint64 linger_us, const DhtId *self, const DhtId *id, MsgNode *nodes);
+static guint dht_table_index(guint num_buckets, guint symbol_bits, const DhtId *metric);
+static guint dht_table_size(guint num_buckets, guint symbol_bits);
+static void dht_client_alloc_table(DhtClient *client);
+static void dht_client_grow_table(DhtClient *client);
+static void dht_client_relayout(DhtClient *client, guint symbol_bits, guint node_count, guint replacement_count);
+static void dht_socket_set_buffers(GSocket *socket, guint size);
+static void dht_client_publish(DhtClient *client);
+static DhtSnapshot* dht_snapshot_ref(DhtSnapshot *snapshot);
+static void dht_snapshot_unref(DhtSnapshot *snapshot);
+static DhtReceiver* dht_receiver_new(void);
+static guint dht_receiver_receive(DhtReceiver *receiver, GSocket *socket);
+static void dht_client_notify_peers(DhtClient *client);
+static GBytes* dht_client_pack_nodes(DhtClient *client);
+static void dht_client_save_cb(GObject *source, GAsyncResult *result, gpointer user_data);
+static void dht_client_random_id(DhtClient *client, DhtId *id, guint index);
+static void dht_client_refresh(DhtClient *client, const DhtId *id, gboolean is_filling);
+static void dht_client_touch(DhtClient *client, const DhtId *id);
+static gboolean dht_client_admit(DhtClient *client, const DhtAddress *addr);
+static gboolean dht_source_admit(DhtSource *sources, const DhtAddress *addr, gint64 timestamp);
+static gboolean dht_rate_admit(gint64 *deadline, gint64 timestamp, gint64 interval, guint burst);
+static guint dht_bucket_select(const DhtBucket *bucket, const DhtId *id, gint64 timestamp, gint64 linger_us, MsgNode *nodes, DhtId *metrics, guint count, guint node_count);
+static void dht_bucket_purge(DhtClient *client, DhtBucket *bucket, gint64 timestamp);
+static void dht_bucket_remember(DhtClient *client, DhtBucket *bucket, const DhtId *id, const DhtAddress *addr, gint64 rtt);
+static void dht_bucket_forget(DhtBucket *bucket, const DhtId *id, const DhtAddress *addr);
+static gboolean dht_bucket_promote(DhtBucket *bucket, DhtNode *node);
+static void dht_bucket_refill(DhtClient *client, DhtBucket *bucket);
+static DhtQuery* dht_lookup_find(DhtLookup *lookup, const DhtAddress *addr);
+static DhtQuery* dht_lookup_insert(DhtLookup *lookup, const DhtId *metric, const DhtAddress *addr);
+static void dht_lookup_sort(DhtLookup *lookup, DhtQuery *query);
 static void dht_lookup_update(DhtLookup *lookup, const MsgNode *nodes, guint count);
+static void dht_lookup_adapt(DhtLookup *lookup, gboolean has_progress);
+static gint64 dht_lookup_rtt(DhtLookup *lookup, const DhtQuery *query);
+static DhtQuery* dht_lookup_select(DhtLookup *lookup, guint first);
 static void dht_lookup_dispatch(DhtLookup *lookup);
-
-static gboolean dht_client_refresh_cb(gpointer arg);
+static void dht_lookup_finish(DhtLookup *lookup);
+static void dht_lookup_resolve(DhtLookup *lookup, const DhtAddress *addr);
+static DhtId* dht_lookup_siblings(DhtLookup *lookup, guint *count);
+static void dht_probe_next(DhtProbe *probe);
+static gboolean dht_probe_start_cb(gpointer arg);
+static void dht_probe_free(DhtProbe *probe);
+
+static void dht_client_refresh_cb(gpointer arg);
+static void dht_client_sweep_cb(gpointer arg);
+static void dht_client_cookie_cb(gpointer arg);
+static void dht_client_fill_cb(gpointer arg);
+static gboolean dht_client_notify_cb(gpointer arg);
 static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, gpointer arg);
-static gboolean dht_query_timeout_cb(gpointer arg);
-static gboolean dht_connection_timeout_cb(gpointer arg);
+static void dht_client_publish_cb(gpointer arg);
+static gboolean dht_client_inbox_cb(gpointer arg);
+static gboolean dht_inbox_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+static gpointer dht_worker_thread(gpointer arg);
+static gboolean dht_worker_receive_cb(GSocket *socket, GIOCondition condition, gpointer arg);
+static gboolean dht_worker_quit_cb(gpointer arg);
+static gboolean dht_packet_is_valid(const guint8 *buffer, gssize len);
+static void dht_handshake_thread(gpointer data, gpointer user_data);
+static void dht_handshake_free(DhtHandshake *handshake);
+static void dht_client_handle(DhtClient *client, const DhtAddress *addr, guint8 *buffer, gssize len);
+static void dht_query_timeout_cb(gpointer arg);
+static void dht_query_hedge_cb(gpointer arg);
+static void dht_connection_timeout_cb(gpointer arg);
+static void dht_connection_request(DhtConnection *connection);
 
-static void dht_node_destroy_cb(gpointer arg);
-static void dht_bucket_destroy_cb(gpointer arg);
-static void dht_query_destroy_cb(gpointer arg);
 static void dht_lookup_destroy_cb(gpointer arg);
 static void dht_connection_destroy_cb(gpointer arg);
+static void dht_peer_destroy_cb(gpointer arg);
+static void dht_worker_destroy_cb(gpointer arg);
 static void dht_result_destroy_cb(gpointer arg);
 
+static GSourceFuncs dht_inbox_funcs =
+{
+    NULL, NULL, dht_inbox_dispatch, NULL
+};
+
 static void dht_client_class_init(DhtClientClass *client_class)
 {
     GObjectClass *object_class = (GObjectClass*)client_class;
@@ -210,6 +530,48 @@ static void dht_client_class_init(DhtClientClass *client_class)
     dht_client_properties[PROP_LISTEN] = g_param_spec_boolean("listen", "Listen", "Listen for incoming connections", FALSE,
             G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+    dht_client_properties[PROP_CACHE_FILE] = g_param_spec_string("cache-file", "Cache file", "Node cache saved periodically and on exit", NULL,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_MIN_CONCURRENCY] = g_param_spec_uint("min-concurrency", "Minimum concurrency", "Lower bound of concurrent requests per lookup",
+            1, DHT_BURST_COUNT, DHT_CONCURRENCY_MIN, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_MAX_CONCURRENCY] = g_param_spec_uint("max-concurrency", "Maximum concurrency", "Upper bound of concurrent requests per lookup",
+            1, DHT_BURST_COUNT, DHT_CONCURRENCY_MAX, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_COOKIES] = g_param_spec_boolean("cookies", "Cookies", "Require a stateless round trip before key exchange", FALSE,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_FILL_BUDGET] = g_param_spec_uint("fill-budget", "Fill budget", "Requests allowed for filling every bucket after bootstrap",
+            0, G_MAXUINT, DHT_FILL_BUDGET, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_SYMBOL_BITS] = g_param_spec_uint("symbol-bits", "Symbol bits", "ID bits resolved per routing step, each prefix length keeps 2^(b-1) buckets",
+            1, DHT_SYMBOL_BITS_MAX, 1, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_NODE_COUNT] = g_param_spec_uint("node-count", "Node count", "Nodes per bucket and per lookup result (k)",
+            1, DHT_NODE_COUNT_MAX, DHT_NODE_COUNT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_REPLACEMENT_COUNT] = g_param_spec_uint("replacement-count", "Replacement count", "Replacement nodes cached per bucket",
+            0, DHT_REPLACEMENT_COUNT_MAX, DHT_REPLACEMENT_COUNT, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_CONCURRENCY] = g_param_spec_uint("concurrency", "Concurrency", "Initial concurrent requests per lookup",
+            1, DHT_BURST_COUNT, DHT_CONCURRENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_TIMEOUT] = g_param_spec_uint("timeout", "Timeout", "Request timeout for nodes without a measured round trip, in milliseconds",
+            DHT_TIMEOUT_MIN_MS, G_MAXINT, DHT_TIMEOUT_MS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_REFRESH_INTERVAL] = g_param_spec_uint("refresh-interval", "Refresh interval", "Longest wait between bucket refresh checks, in milliseconds",
+            1000, G_MAXINT, DHT_REFRESH_MS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_REFRESH_IDLE] = g_param_spec_uint("refresh-idle", "Refresh idle", "Seconds without a lookup or response before a bucket is refreshed",
+            1, G_MAXUINT, DHT_REFRESH_IDLE_US / G_USEC_PER_SEC, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_LINGER] = g_param_spec_uint("linger", "Linger", "Seconds a dead node stays in its bucket without a replacement",
+            0, G_MAXUINT, DHT_LINGER_US / G_USEC_PER_SEC, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
+    dht_client_properties[PROP_SOCKET_BUFFER] = g_param_spec_uint("socket-buffer", "Socket buffer", "Kernel send and receive buffer size in bytes, zero for system default",
+            0, G_MAXINT, 0, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
     g_object_class_install_properties(object_class, PROP_LAST, dht_client_properties);
 
     dht_client_signals[SIGNAL_NEW_CONNECTION] = g_signal_new("new-connection",
@@ -221,11 +583,44 @@ static void dht_client_init(DhtClient *client)
 {
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
-    priv->buckets = g_list_alloc();
     priv->num_buckets = 1;
+    priv->symbol_bits = 1;
+    priv->node_count = DHT_NODE_COUNT;
+    priv->replacement_count = DHT_REPLACEMENT_COUNT;
+    priv->concurrency = DHT_CONCURRENCY;
+    priv->timeout_ms = DHT_TIMEOUT_MS;
+    priv->refresh_ms = DHT_REFRESH_MS;
+    priv->refresh_idle_us = DHT_REFRESH_IDLE_US;
+    priv->linger_us = DHT_LINGER_US;
+    dht_client_alloc_table(client);
+    priv->min_concurrency = DHT_CONCURRENCY_MIN;
+    priv->max_concurrency = DHT_CONCURRENCY_MAX;
+    priv->fill_budget = DHT_FILL_BUDGET;
 
     priv->lookup_table = g_hash_table_new_full(dht_id_hash, dht_id_equal, NULL, dht_lookup_destroy_cb);
     priv->connection_table = g_hash_table_new_full(dht_key_hash, dht_key_equal, NULL, dht_connection_destroy_cb);
+    priv->peer_table = g_hash_table_new(dht_id_hash, dht_id_equal);
+    priv->peer_queue = g_queue_new();
+    priv->timer_wheel = dht_timer_wheel_new();
+    priv->save_cancellable = g_cancellable_new();
+    priv->key_cache = dht_key_cache_new();
+    priv->receiver = dht_receiver_new();
+    priv->sources = g_new0(DhtSource, 1 << DHT_SOURCE_BITS);
+    priv->send_packets = g_new(DhtPacket, MSG_BATCH_COUNT);
+    priv->inbox = g_async_queue_new();
+    priv->handshakes = g_async_queue_new();
+    priv->crypto_pool = g_thread_pool_new(dht_handshake_thread, client, DHT_CRYPTO_THREADS, FALSE, NULL);
+    priv->inbox_source = g_source_new(&dht_inbox_funcs, sizeof(GSource));
+    g_source_set_callback(priv->inbox_source, dht_client_inbox_cb, client, NULL);
+    g_source_attach(priv->inbox_source, g_main_context_default());
+    g_mutex_init(&priv->snapshot_mutex);
+    dht_timer_init(&priv->refresh_timer, priv->timer_wheel, dht_client_refresh_cb, client);
+    dht_timer_init(&priv->sweep_timer, priv->timer_wheel, dht_client_sweep_cb, client);
+    dht_timer_init(&priv->snapshot_timer, priv->timer_wheel, dht_client_publish_cb, client);
+    dht_timer_init(&priv->cookie_timer, priv->timer_wheel, dht_client_cookie_cb, client);
+    dht_timer_init(&priv->fill_timer, priv->timer_wheel, dht_client_fill_cb, client);
+    dht_key_make_random(&priv->cookie_secrets[0]);
+    priv->cookie_secrets[1] = priv->cookie_secrets[0];
 
     // Create socket
     g_autoptr(GError) error = NULL;
@@ -236,11 +631,26 @@ static void dht_client_init(DhtClient *client)
         return;
     }
 
+#ifdef HAVE_SENDMMSG
+    guint j;
+    for(j = 0; j < MSG_BATCH_COUNT; j++)
+    {
+        priv->send_vectors[j].iov_base = priv->send_packets[j].data;
+
+        memset(&priv->send_messages[j].msg_hdr, 0, sizeof(struct msghdr));
+        priv->send_messages[j].msg_hdr.msg_iov = &priv->send_vectors[j];
+        priv->send_messages[j].msg_hdr.msg_iovlen = 1;
+        priv->send_messages[j].msg_hdr.msg_name = &priv->send_addresses[j];
+    }
+#endif /* HAVE_SENDMMSG */
+
     // Attach sources
     g_autoptr(GSource) source = g_socket_create_source(priv->socket, G_IO_IN, NULL);
     g_source_set_callback(source, (GSourceFunc)dht_client_receive_cb, client, NULL);
     priv->socket_source = g_source_attach(source, g_main_context_default());
-    priv->timeout_source = g_timeout_add(DHT_REFRESH_MS, dht_client_refresh_cb, client);
+    dht_timer_start(&priv->refresh_timer, priv->refresh_ms);
+    dht_timer_start(&priv->sweep_timer, DHT_SWEEP_MS);
+    dht_timer_start(&priv->cookie_timer, DHT_COOKIE_MS);
 }
 
 static void dht_client_set_property(GObject *obj, guint prop_id, const GValue *value, GParamSpec *pspec)
@@ -265,6 +675,78 @@ static void dht_client_set_property(GObject *obj, guint prop_id, const GValue *v
             priv->listen = g_value_get_boolean(value);
             break;
 
+        case PROP_CACHE_FILE:
+            g_free(priv->cache_file);
+            priv->cache_file = g_value_dup_string(value);
+            break;
+
+        case PROP_MIN_CONCURRENCY:
+            priv->min_concurrency = g_value_get_uint(value);
+            break;
+
+        case PROP_MAX_CONCURRENCY:
+            priv->max_concurrency = g_value_get_uint(value);
+            break;
+
+        case PROP_COOKIES:
+            priv->cookies = g_value_get_boolean(value);
+            break;
+
+        case PROP_FILL_BUDGET:
+            priv->fill_budget = g_value_get_uint(value);
+            break;
+
+        case PROP_SYMBOL_BITS:
+            if(g_value_get_uint(value) != priv->symbol_bits)
+                dht_client_relayout(client, g_value_get_uint(value), priv->node_count, priv->replacement_count);
+            break;
+
+        case PROP_NODE_COUNT:
+            if(g_value_get_uint(value) != priv->node_count)
+                dht_client_relayout(client, priv->symbol_bits, g_value_get_uint(value), priv->replacement_count);
+            break;
+
+        case PROP_REPLACEMENT_COUNT:
+            if(g_value_get_uint(value) != priv->replacement_count)
+                dht_client_relayout(client, priv->symbol_bits, priv->node_count, g_value_get_uint(value));
+            break;
+
+        case PROP_CONCURRENCY:
+            priv->concurrency = g_value_get_uint(value);
+            break;
+
+        case PROP_TIMEOUT:
+            priv->timeout_ms = g_value_get_uint(value);
+            break;
+
+        case PROP_REFRESH_INTERVAL:
+            priv->refresh_ms = g_value_get_uint(value);
+            if(dht_timer_is_active(&priv->refresh_timer))
+                dht_timer_start(&priv->refresh_timer, priv->refresh_ms);
+            break;
+
+        case PROP_REFRESH_IDLE:
+            // Next check may be due only after the old threshold, pull it in to the interval
+            priv->refresh_idle_us = (gint64)g_value_get_uint(value) * G_USEC_PER_SEC;
+            if(dht_timer_is_active(&priv->refresh_timer))
+                dht_timer_start(&priv->refresh_timer, priv->refresh_ms);
+            break;
+
+        case PROP_LINGER:
+            priv->linger_us = (gint64)g_value_get_uint(value) * G_USEC_PER_SEC;
+            priv->snapshot_dirty = TRUE;
+            break;
+
+        case PROP_SOCKET_BUFFER:
+        {
+            GSList *iter;
+            priv->socket_buffer = g_value_get_uint(value);
+            if(priv->socket) dht_socket_set_buffers(priv->socket, priv->socket_buffer);
+            for(iter = priv->workers; iter; iter = iter->next)
+                dht_socket_set_buffers(((DhtWorker*)iter->data)->socket, priv->socket_buffer);
+            break;
+        }
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop_id, pspec);
             break;
@@ -294,6 +776,62 @@ static void dht_client_get_property(GObject *obj, guint prop, GValue *value, GPa
             g_value_set_boolean(value, priv->listen);
             break;
 
+        case PROP_CACHE_FILE:
+            g_value_set_string(value, priv->cache_file);
+            break;
+
+        case PROP_MIN_CONCURRENCY:
+            g_value_set_uint(value, priv->min_concurrency);
+            break;
+
+        case PROP_MAX_CONCURRENCY:
+            g_value_set_uint(value, priv->max_concurrency);
+            break;
+
+        case PROP_COOKIES:
+            g_value_set_boolean(value, priv->cookies);
+            break;
+
+        case PROP_FILL_BUDGET:
+            g_value_set_uint(value, priv->fill_budget);
+            break;
+
+        case PROP_SYMBOL_BITS:
+            g_value_set_uint(value, priv->symbol_bits);
+            break;
+
+        case PROP_NODE_COUNT:
+            g_value_set_uint(value, priv->node_count);
+            break;
+
+        case PROP_REPLACEMENT_COUNT:
+            g_value_set_uint(value, priv->replacement_count);
+            break;
+
+        case PROP_CONCURRENCY:
+            g_value_set_uint(value, priv->concurrency);
+            break;
+
+        case PROP_TIMEOUT:
+            g_value_set_uint(value, priv->timeout_ms);
+            break;
+
+        case PROP_REFRESH_INTERVAL:
+            g_value_set_uint(value, priv->refresh_ms);
+            break;
+
+        case PROP_REFRESH_IDLE:
+            g_value_set_uint(value, priv->refresh_idle_us / G_USEC_PER_SEC);
+            break;
+
+        case PROP_LINGER:
+            g_value_set_uint(value, priv->linger_us / G_USEC_PER_SEC);
+            break;
+
+        case PROP_SOCKET_BUFFER:
+            g_value_set_uint(value, priv->socket_buffer);
+            break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(obj, prop, pspec);
             break;
@@ -315,6 +853,57 @@ gboolean dht_client_bind(DhtClient *client, GSocketAddress *address, gboolean al
     return g_socket_bind(priv->socket, address, allow_reuse, error);
 }
 
+gboolean dht_client_start_workers(DhtClient *client, guint count, GError **error)
+{
+    g_return_val_if_fail(DHT_IS_CLIENT(client), FALSE);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    g_autoptr(GSocketAddress) address = g_socket_get_local_address(priv->socket, error);
+    if(!address) return FALSE;
+
+    // Workers answer from a published copy of the routing table
+    if(!dht_timer_is_active(&priv->snapshot_timer))
+    {
+        dht_client_publish(client);
+        dht_timer_start(&priv->snapshot_timer, DHT_SNAPSHOT_MS);
+    }
+
+    guint i;
+    for(i = 0; i < count; i++)
+    {
+        // Kernel spreads datagrams over all sockets bound to the port
+        g_autoptr(GSocket) socket = g_socket_new(DHT_ADDRESS_FAMILY, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, error);
+        if(!socket || !g_socket_bind(socket, address, TRUE, error))
+            return FALSE;
+
+        dht_socket_set_buffers(socket, priv->socket_buffer);
+
+        DhtWorker *worker = g_slice_new0(DhtWorker);
+        worker->socket = g_object_ref(socket);
+        worker->context = g_main_context_new();
+        worker->loop = g_main_loop_new(worker->context, FALSE);
+        worker->receiver = dht_receiver_new();
+        worker->sources = g_new0(DhtSource, 1 << DHT_SOURCE_BITS);
+        worker->client = client;
+
+        g_autoptr(GSource) source = g_socket_create_source(socket, G_IO_IN, NULL);
+        g_source_set_callback(source, (GSourceFunc)dht_worker_receive_cb, worker, NULL);
+        g_source_attach(source, worker->context);
+
+        worker->thread = g_thread_try_new("dht-worker", dht_worker_thread, worker, error);
+        if(!worker->thread)
+        {
+            dht_worker_destroy_cb(worker);
+            return FALSE;
+        }
+
+        priv->workers = g_slist_prepend(priv->workers, worker);
+    }
+
+    g_debug("Started %u workers", count);
+    return TRUE;
+}
+
 void dht_client_bootstrap(DhtClient *client, GSocketAddress *address)
 {
     g_return_if_fail(DHT_IS_CLIENT(client));
@@ -322,22 +911,68 @@ void dht_client_bootstrap(DhtClient *client, GSocketAddress *address)
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
     DhtLookup *lookup = g_hash_table_lookup(priv->lookup_table, &priv->id);
-    if(!lookup)
-    {
-        lookup = g_slice_new(DhtLookup);
-        lookup->client = client;
-        lookup->id = priv->id;
-        lookup->num_sources = 0;
-        lookup->query_sequence = g_sequence_new(dht_query_destroy_cb);
-        lookup->query_table = g_hash_table_new(dht_address_hash, dht_address_equal);
-        lookup->results = NULL;
-        g_hash_table_insert(priv->lookup_table, &lookup->id, lookup);
-    }
+    if(!lookup) lookup = dht_lookup_new(client, &priv->id);
 
     MsgNode node;
     memset(node.id.data, 0, DHT_ID_SIZE);
     dht_address_serialize(&node.addr, address);
     dht_lookup_update(lookup, &node, 1);
+    dht_client_flush(client);
+}
+
+gboolean dht_client_load_nodes(DhtClient *client, const gchar *path, GError **error)
+{
+    g_return_val_if_fail(DHT_IS_CLIENT(client), FALSE);
+    g_return_val_if_fail(path != NULL, FALSE);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    g_autoptr(GMappedFile) file = g_mapped_file_new(path, FALSE, error);
+    if(!file) return FALSE;
+
+    gsize len = g_mapped_file_get_length(file);
+    if(len % sizeof(MsgNode))
+    {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, _("Invalid node cache"));
+        return FALSE;
+    }
+
+    guint count = len / sizeof(MsgNode);
+    g_debug("Restoring %u nodes", count);
+    if(count == 0) return TRUE;
+
+    // Kept to fill up later saves while the table is still sparse
+    g_clear_pointer(&priv->saved_nodes, g_bytes_unref);
+    priv->saved_nodes = g_bytes_new(g_mapped_file_get_contents(file), len);
+
+    DhtLookup *lookup = g_hash_table_lookup(priv->lookup_table, &priv->id);
+    if(!lookup) lookup = dht_lookup_new(client, &priv->id);
+
+    // Revalidate cached nodes in a single burst
+    lookup->concurrency = DHT_BURST_COUNT;
+    dht_lookup_update(lookup, (const MsgNode*)g_mapped_file_get_contents(file), count);
+
+    lookup = g_hash_table_lookup(priv->lookup_table, &priv->id);
+    if(lookup) lookup->concurrency = CLAMP(priv->concurrency, priv->min_concurrency, MAX(priv->min_concurrency, priv->max_concurrency));
+
+    dht_client_flush(client);
+    return TRUE;
+}
+
+gboolean dht_client_save_nodes(DhtClient *client, const gchar *path, GError **error)
+{
+    g_return_val_if_fail(DHT_IS_CLIENT(client), FALSE);
+    g_return_val_if_fail(path != NULL, FALSE);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    g_autoptr(GBytes) bytes = dht_client_pack_nodes(client);
+    if(!bytes) return TRUE;
+
+    if(!g_file_set_contents(path, g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), error))
+        return FALSE;
+
+    g_clear_pointer(&priv->saved_nodes, g_bytes_unref);
+    priv->saved_nodes = g_bytes_ref(bytes);
+    return TRUE;
 }
 
 void dht_client_lookup_async(DhtClient *client, const DhtId *id, GAsyncReadyCallback callback, gpointer user_data)
@@ -363,19 +998,106 @@ void dht_client_lookup_async(DhtClient *client, const DhtId *id, GAsyncReadyCall
     }
 
     // Create lookup
-    lookup = g_slice_new(DhtLookup);
-    lookup->client = client;
-    lookup->id = *id;
-    lookup->num_sources = 0;
-    lookup->query_sequence = g_sequence_new(dht_query_destroy_cb);
-    lookup->query_table = g_hash_table_new(dht_address_hash, dht_address_equal);
+    lookup = dht_lookup_new(client, id);
     lookup->results = g_slist_prepend(NULL, result);
-    g_hash_table_insert(priv->lookup_table, &lookup->id, lookup);
 
     // Dispatch lookup
-    MsgNode nodes[DHT_NODE_COUNT];
+    MsgNode nodes[DHT_NODE_COUNT_MAX];
     guint count = dht_client_search(client, id, nodes);
     dht_lookup_update(lookup, nodes, count);
+
+    // Try recently resolved address in parallel
+    const DhtAddress *addr = dht_client_find_peer(client, id);
+    if(addr && g_hash_table_contains(priv->lookup_table, id))
+    {
+        g_debug("Connecting to cached peer %08x", dht_id_hash(id));
+        priv->stats.peer_hits++;
+        dht_client_connect(client, id, addr, NULL);
+    }
+
+    dht_client_flush(client);
+}
+
+void dht_client_probe_many_async(DhtClient *client, const DhtId *ids, guint count, DhtProbeCallback progress, gpointer progress_data,
+        GAsyncReadyCallback callback, gpointer user_data)
+{
+    g_return_if_fail(DHT_IS_CLIENT(client));
+    g_return_if_fail((ids != NULL) || (count == 0));
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtProbe *probe = g_slice_new0(DhtProbe);
+    probe->client = client;
+    probe->progress = progress;
+    probe->progress_data = progress_data;
+    probe->result = g_simple_async_result_new(G_OBJECT(client), callback, user_data, NULL);
+    priv->probes = g_slist_prepend(priv->probes, probe);
+
+    // Neighbouring targets share most of their path, resolve them close in time
+    probe->targets = g_new(DhtId, MAX(count, 1));
+    memcpy(probe->targets, ids, count * sizeof(DhtId));
+    g_qsort_with_data(probe->targets, count, sizeof(DhtId), dht_id_compare, NULL);
+
+    guint i;
+    for(i = 0; i < count; i++)
+    {
+        const DhtId *id = &probe->targets[i];
+        if(dht_id_equal(id, &priv->id)) continue;
+        if((probe->num_targets > 0) && dht_id_equal(id, &probe->targets[probe->num_targets - 1])) continue;
+
+        probe->targets[probe->num_targets++] = *id;
+    }
+
+    probe->num_pending = probe->num_targets;
+    priv->stats.probe_targets += probe->num_targets;
+
+    // Targets found in the table resolve at once, report them after returning like the completion
+    probe->start_source = g_idle_add(dht_probe_start_cb, probe);
+}
+
+gboolean dht_client_probe_many_finish(DhtClient *client, GAsyncResult *result, guint *num_found, GError **error)
+{
+    g_return_val_if_fail(DHT_IS_CLIENT(client), FALSE);
+    if(g_simple_async_result_propagate_error(G_SIMPLE_ASYNC_RESULT(result), error))
+        return FALSE;
+
+    if(num_found) *num_found = g_simple_async_result_get_op_res_gssize(G_SIMPLE_ASYNC_RESULT(result));
+    return TRUE;
+}
+
+void dht_client_get_stats(DhtClient *client, DhtClientStats *stats)
+{
+    g_return_if_fail(DHT_IS_CLIENT(client));
+    g_return_if_fail(stats != NULL);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    *stats = priv->stats;
+
+    // Each hit saves one key exchange of the average measured cost
+    gint64 miss_time;
+    dht_key_cache_get_stats(priv->key_cache, &stats->key_cache_hits, &stats->key_cache_misses, &miss_time);
+    if(stats->key_cache_misses > 0)
+        stats->key_cache_saved_us = stats->key_cache_hits * miss_time / stats->key_cache_misses;
+
+    GSList *iter;
+    for(iter = priv->workers; iter; iter = iter->next)
+    {
+        stats->requests_dropped += g_atomic_int_get(&((DhtWorker*)iter->data)->requests_dropped);
+        stats->inbox_dropped += g_atomic_int_get(&((DhtWorker*)iter->data)->inbox_dropped);
+    }
+}
+
+gboolean dht_client_get_rtt(DhtClient *client, const DhtId *id, gint64 *srtt, gint64 *rttvar)
+{
+    g_return_val_if_fail(DHT_IS_CLIENT(client), FALSE);
+    g_return_val_if_fail(id != NULL, FALSE);
+
+    DhtNode *node = dht_client_find(client, id);
+    if(!node || (node->srtt == 0))
+        return FALSE;
+
+    if(srtt) *srtt = node->srtt;
+    if(rttvar) *rttvar = node->rttvar;
+    return TRUE;
 }
 
 gboolean dht_client_lookup_finish(DhtClient *client, GAsyncResult *result, GSocket **socket, DhtKey *enc_key, DhtKey *dec_key, GError **error)
@@ -397,65 +1119,132 @@ static void dht_client_finalize(GObject *obj)
     DhtClient *client = DHT_CLIENT(obj);
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
+    // Join workers before the state they read is released
+    g_slist_free_full(priv->workers, dht_worker_destroy_cb);
+    g_thread_pool_free(priv->crypto_pool, FALSE, TRUE);
+
+    // Final save replaces any periodic one still in progress
+    g_cancellable_cancel(priv->save_cancellable);
+    g_object_unref(priv->save_cancellable);
+    if(priv->cache_file)
+    {
+        g_autoptr(GError) error = NULL;
+        dht_client_save_nodes(client, priv->cache_file, &error);
+        if(error) g_warning("%s", error->message);
+        g_free(priv->cache_file);
+    }
+
+    g_clear_pointer(&priv->saved_nodes, g_bytes_unref);
+
+    // Cancel probes before their lookups are released
+    while(priv->probes)
+    {
+        DhtProbe *probe = priv->probes->data;
+        GSList *iter;
+        for(iter = probe->lookups; iter; iter = iter->next)
+        {
+            DhtLookup *lookup = iter->data;
+            lookup->probes = g_slist_remove(lookup->probes, probe);
+        }
+
+        g_simple_async_result_set_error(probe->result, G_IO_ERROR, G_IO_ERROR_CANCELLED, _("Operation cancelled"));
+        dht_probe_free(probe);
+    }
+
     g_hash_table_destroy(priv->lookup_table);
     g_hash_table_destroy(priv->connection_table);
-    g_list_free_full(priv->buckets, dht_bucket_destroy_cb);
+    g_hash_table_destroy(priv->peer_table);
+    g_queue_free_full(priv->peer_queue, dht_peer_destroy_cb);
 
     if(priv->socket)
     {
         g_object_unref(priv->socket);
         g_source_remove(priv->socket_source);
-        g_source_remove(priv->timeout_source);
     }
 
+    if(priv->notify_source > 0)
+        g_source_remove(priv->notify_source);
+
+    g_source_destroy(priv->inbox_source);
+    g_source_unref(priv->inbox_source);
+
+    DhtPacket *packet;
+    while((packet = g_async_queue_try_pop(priv->inbox)))
+        g_slice_free(DhtPacket, packet);
+
+    DhtHandshake *handshake;
+    while((handshake = g_async_queue_try_pop(priv->handshakes)))
+        dht_handshake_free(handshake);
+
+    g_async_queue_unref(priv->inbox);
+    g_async_queue_unref(priv->handshakes);
+    if(priv->snapshot) dht_snapshot_unref(priv->snapshot);
+    g_mutex_clear(&priv->snapshot_mutex);
+
+    dht_timer_wheel_free(priv->timer_wheel);
+    dht_key_cache_free(priv->key_cache);
+    g_free(priv->receiver);
+    g_free(priv->sources);
+    g_free(priv->send_packets);
+    g_free(priv->buckets);
+    g_free(priv->storage);
+
     G_OBJECT_CLASS(dht_client_parent_class)->finalize(obj);
 }
 
-static void dht_client_update(DhtClient *client, const DhtId *id, const DhtAddress *addr, gboolean is_alive)
+static void dht_client_update(DhtClient *client, const DhtId *id, const DhtAddress *addr, gboolean is_alive, gint64 rtt)
 {
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
     g_debug("Update node %08x (%s)", dht_id_hash(id), is_alive ? "alive" : "timed-out");
+    priv->snapshot_dirty = TRUE;
 
     DhtId metric;
     dht_id_xor(&metric, &priv->id, id);
 
-    guint nbits;
-    GList *bucket = priv->buckets;
-    for(nbits = 0; bucket->next && !(metric.data[nbits / 8] & (0x80 >> nbits % 8)); nbits++)
-        bucket = bucket->next;
+    guint nbits = MIN(dht_id_prefix_len(&metric), priv->num_buckets - 1);
+    DhtBucket *bucket = &priv->buckets[dht_table_index(priv->num_buckets, priv->symbol_bits, &metric)];
+    if(is_alive) bucket->timestamp = g_get_monotonic_time();
 
     // Iterate nodes
-    guint count = 0;
-    DhtNode *replaceable = NULL;
-    GList *link = bucket->data;
-    while(link)
+    DhtNode *node, *replaceable = NULL;
+    for(node = bucket->nodes; node < bucket->nodes + bucket->num_nodes; node++)
     {
-        DhtNode *node = link->data;
         if(dht_id_equal(&node->id, id))
         {
             // Update existing node
             if(is_alive)
             {
+                if(!dht_address_equal(&node->addr, addr))
+                    node->srtt = node->rttvar = 0;
+
                 node->timestamp = g_get_monotonic_time();
                 node->is_alive = TRUE;
                 node->addr = *addr;
+                dht_node_sample_rtt(node, rtt);
             }
             else if(dht_address_equal(&node->addr, addr))
+            {
                 node->is_alive = FALSE;
 
+                // Promote most recently seen replacement
+                if(dht_bucket_promote(bucket, node))
+                    g_debug("Promote node %08x", dht_id_hash(&node->id));
+            }
+
             return;
         }
 
         if(!node->is_alive)
             replaceable = node; // mark node for replacement
-
-        link = link->next;
-        count++;
     }
 
-    if(!is_alive) return;
-
-    if(count == DHT_NODE_COUNT)
+    if(!is_alive)
+    {
+        dht_bucket_forget(bucket, id, addr);
+        return;
+    }
+
+    if(bucket->num_nodes == priv->node_count)
     {
         if(replaceable)
         {
@@ -464,312 +1253,1800 @@ static void dht_client_update(DhtClient *client, const DhtId *id, const DhtAddre
             replaceable->is_alive = TRUE;
             replaceable->addr = *addr;
             replaceable->id = *id;
+            replaceable->srtt = replaceable->rttvar = 0;
+            dht_node_sample_rtt(replaceable, rtt);
+            dht_bucket_forget(bucket, id, NULL);
+        }
+        else
+        {
+            // Keep node as a replacement, responsive nodes are never displaced
+            dht_bucket_remember(client, bucket, id, addr, rtt);
+        }
+
+        return;
+    }
+
+    // Insert new node
+    node = &bucket->nodes[bucket->num_nodes++];
+    node->timestamp = g_get_monotonic_time();
+    node->is_alive = TRUE;
+    node->addr = *addr;
+    node->id = *id;
+    node->srtt = node->rttvar = 0;
+    dht_node_sample_rtt(node, rtt);
+    dht_bucket_forget(bucket, id, NULL);
+
+    priv->num_peers++;
+    dht_client_notify_peers(client);
+
+    // Split buckets
+    while((bucket->num_nodes == priv->node_count) && (nbits == priv->num_buckets - 1) && (priv->num_buckets < DHT_BUCKET_COUNT))
+    {
+        // The tail keeps its storage, so its entries are copied out first
+        DhtNode tail_nodes[DHT_NODE_COUNT_MAX], tail_replacements[DHT_REPLACEMENT_COUNT_MAX];
+        guint num_nodes = bucket->num_nodes, num_replacements = bucket->num_replacements;
+        gint64 timestamp = bucket->timestamp;
+        memcpy(tail_nodes, bucket->nodes, num_nodes * sizeof(DhtNode));
+        memcpy(tail_replacements, bucket->replacements, num_replacements * sizeof(DhtNode));
+        bucket->num_nodes = bucket->num_replacements = 0;
+        priv->num_buckets++;
+        dht_client_grow_table(client);
+
+        // Nodes differing in the next bit are spread by their symbol, the rest form the new tail
+        guint i, first = nbits << (priv->symbol_bits - 1);
+        guint last = dht_table_size(priv->num_buckets, priv->symbol_bits) - 1;
+        for(i = first; i <= last; i++)
+            priv->buckets[i].timestamp = timestamp;
+
+        for(i = 0; i < num_nodes; i++)
+        {
+            node = &tail_nodes[i];
+            dht_id_xor(&metric, &priv->id, &node->id);
+
+            DhtBucket *target = &priv->buckets[dht_table_index(priv->num_buckets, priv->symbol_bits, &metric)];
+            target->nodes[target->num_nodes++] = *node;
+        }
+
+        for(i = 0; i < num_replacements; i++)
+        {
+            node = &tail_replacements[i];
+            dht_id_xor(&metric, &priv->id, &node->id);
+
+            DhtBucket *target = &priv->buckets[dht_table_index(priv->num_buckets, priv->symbol_bits, &metric)];
+            target->replacements[target->num_replacements++] = *node;
+        }
+
+        for(i = first; i <= last; i++)
+            dht_bucket_refill(client, &priv->buckets[i]);
+
+        bucket = &priv->buckets[last];
+        nbits++;
+    }
+}
+
+static DhtNode* dht_client_find(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtId metric;
+    dht_id_xor(&metric, &priv->id, id);
+
+    DhtBucket *bucket = &priv->buckets[dht_table_index(priv->num_buckets, priv->symbol_bits, &metric)];
+
+    DhtNode *node;
+    for(node = bucket->nodes; node < bucket->nodes + bucket->num_nodes; node++)
+    {
+        if(dht_id_equal(&node->id, id))
+            return node;
+    }
+
+    return NULL;
+}
+
+static guint dht_client_timeout(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    DhtNode *node = dht_client_find(client, id);
+    if(!node || (node->srtt == 0))
+        return priv->timeout_ms;
+
+    // Retransmission timeout as in RFC 6298
+    gint64 timeout = node->srtt + MAX(4 * node->rttvar, 1000);
+    return CLAMP(timeout / 1000, DHT_TIMEOUT_MIN_MS, priv->timeout_ms);
+}
+
+static void dht_node_sample_rtt(DhtNode *node, gint64 rtt)
+{
+    if(rtt <= 0) return;
+
+    if(node->srtt == 0)
+    {
+        node->srtt = rtt;
+        node->rttvar = rtt / 2;
+    }
+    else
+    {
+        node->rttvar = (3 * node->rttvar + ABS(node->srtt - rtt)) / 4;
+        node->srtt = (7 * node->srtt + rtt) / 8;
+    }
+
+    g_debug("Node %08x RTT %" G_GINT64_FORMAT " us (variance %" G_GINT64_FORMAT " us)", dht_id_hash(&node->id), node->srtt, node->rttvar);
+}
+
+static void dht_client_sample_rtt(DhtClient *client, gint64 rtt)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    priv->rtt_samples[priv->num_rtt_samples++ % DHT_RTT_SAMPLES] = rtt;
+    priv->hedge_delay = 0;
+}
+
+static gint dht_rtt_compare(gconstpointer a, gconstpointer b)
+{
+    gint64 rtt_a = *(const gint64*)a, rtt_b = *(const gint64*)b;
+    return (rtt_a > rtt_b) - (rtt_a < rtt_b);
+}
+
+static guint dht_client_hedge_delay(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Wait for enough samples
+    if(priv->num_rtt_samples < DHT_RTT_SAMPLES / 4)
+        return 0;
+
+    if(priv->hedge_delay == 0)
+    {
+        // Compute 90th percentile of recent round-trip times
+        gint64 samples[DHT_RTT_SAMPLES];
+        guint count = MIN(priv->num_rtt_samples, DHT_RTT_SAMPLES);
+        memcpy(samples, priv->rtt_samples, count * sizeof(gint64));
+        qsort(samples, count, sizeof(gint64), dht_rtt_compare);
+
+        priv->hedge_delay = samples[count * 9 / 10] / 1000 + 1;
+        g_debug("Hedge delay %u ms", priv->hedge_delay);
+    }
+
+    return priv->hedge_delay;
+}
+
+static void dht_client_merge(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Merge trailing buckets while they fit below the split threshold
+    while(priv->num_buckets > 1)
+    {
+        guint i, last = dht_table_size(priv->num_buckets, priv->symbol_bits) - 1;
+        guint first = last - (1 << (priv->symbol_bits - 1)), count = 0;
+        for(i = first; i <= last; i++)
+            count += priv->buckets[i].num_nodes;
+
+        if(count >= priv->node_count)
+            break;
+
+        // Collect the previous prefix length and the tail into the first of them
+        DhtBucket *prev = &priv->buckets[first];
+        for(i = first + 1; i <= last; i++)
+        {
+            DhtBucket *bucket = &priv->buckets[i];
+            memcpy(prev->nodes + prev->num_nodes, bucket->nodes, bucket->num_nodes * sizeof(DhtNode));
+            prev->num_nodes += bucket->num_nodes;
+            bucket->num_nodes = 0;
+
+            count = MIN(bucket->num_replacements, priv->replacement_count - prev->num_replacements);
+            memcpy(prev->replacements + prev->num_replacements, bucket->replacements, count * sizeof(DhtNode));
+            prev->num_replacements += count;
+            bucket->num_replacements = 0;
+            prev->timestamp = MAX(prev->timestamp, bucket->timestamp);
+        }
+
+        dht_bucket_refill(client, prev);
+        priv->num_buckets--;
+    }
+}
+
+static void dht_client_notify_peers(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Emit at most once per main loop iteration
+    if(priv->notify_source == 0)
+        priv->notify_source = g_idle_add_full(G_PRIORITY_DEFAULT, dht_client_notify_cb, client, NULL);
+}
+
+static gboolean dht_client_admit(DhtClient *client, const DhtAddress *addr)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    if(dht_source_admit(priv->sources, addr, g_get_monotonic_time()))
+        return TRUE;
+
+    priv->stats.requests_dropped++;
+    return FALSE;
+}
+
+static gboolean dht_source_admit(DhtSource *sources, const DhtAddress *addr, gint64 timestamp)
+{
+    guint64 value = 0;
+    memcpy(&value, addr->data, DHT_ADDRESS_SIZE);
+    DhtSource *source = &sources[(value * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)) >> (64 - DHT_SOURCE_BITS)];
+
+    // Colliding source takes over the entry with a full bucket
+    if(!dht_address_equal(&source->addr, addr))
+    {
+        source->addr = *addr;
+        source->deadline = timestamp;
+    }
+
+    return dht_rate_admit(&source->deadline, timestamp, G_USEC_PER_SEC / DHT_SOURCE_RATE, DHT_SOURCE_BURST);
+}
+
+static gboolean dht_rate_admit(gint64 *deadline, gint64 timestamp, gint64 interval, guint burst)
+{
+    // Token bucket kept as the time it refills completely
+    if(*deadline < timestamp)
+        *deadline = timestamp;
+
+    if(*deadline - timestamp > (burst - 1) * interval)
+        return FALSE;
+
+    *deadline += interval;
+    return TRUE;
+}
+
+static guint dht_bucket_select(const DhtBucket *bucket, const DhtId *id, gint64 timestamp, gint64 linger_us, MsgNode *nodes, DhtId *metrics, guint count, guint node_count)
+{
+    DhtId bucket_metrics[DHT_NODE_COUNT_MAX];
+    dht_id_xor_array(bucket_metrics, bucket->nodes, sizeof(DhtNode), bucket->num_nodes, id);
+
+    guint i;
+    for(i = 0; i < bucket->num_nodes; i++)
+    {
+        // Skip expired node
+        if(!bucket->nodes[i].is_alive && (timestamp - bucket->nodes[i].timestamp >= linger_us))
+            continue;
+
+        // Find position in the sorted selection
+        guint pos = count;
+        while((pos > 0) && (dht_id_compare(&bucket_metrics[i], &metrics[pos - 1], NULL) < 0))
+            pos--;
+
+        if(pos == node_count)
+            continue;
+
+        if(count < node_count)
+            count++;
+
+        // Insert node
+        memmove(&metrics[pos + 1], &metrics[pos], (count - 1 - pos) * sizeof(DhtId));
+        memmove(&nodes[pos + 1], &nodes[pos], (count - 1 - pos) * sizeof(MsgNode));
+        metrics[pos] = bucket_metrics[i];
+        nodes[pos].id = bucket->nodes[i].id;
+        nodes[pos].addr = bucket->nodes[i].addr;
+    }
+
+    return count;
+}
+
+static void dht_bucket_purge(DhtClient *client, DhtBucket *bucket, gint64 timestamp)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    guint i = 0;
+    while(i < bucket->num_nodes)
+    {
+        DhtNode *node = &bucket->nodes[i];
+        if(node->is_alive || (timestamp - node->timestamp < priv->linger_us))
+        {
+            i++;
+            continue;
+        }
+
+        g_debug("Delete node %08x", dht_id_hash(&node->id));
+
+        // Replace or delete dead node
+        if(!dht_bucket_promote(bucket, node))
+        {
+            *node = bucket->nodes[--bucket->num_nodes];
+
+            priv->num_peers--;
+            dht_client_notify_peers(client);
+        }
+    }
+}
+
+static void dht_bucket_remember(DhtClient *client, DhtBucket *bucket, const DhtId *id, const DhtAddress *addr, gint64 rtt)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    if(priv->replacement_count == 0)
+        return;
+
+    guint i;
+    for(i = 0; i < bucket->num_replacements; i++)
+    {
+        if(dht_id_equal(&bucket->replacements[i].id, id))
+            break;
+    }
+
+    if(i == bucket->num_replacements)
+    {
+        // Drop least recently seen replacement if full
+        if(bucket->num_replacements < priv->replacement_count)
+            bucket->num_replacements++;
+        else
+            i--;
+    }
+
+    // Move to front
+    memmove(&bucket->replacements[1], &bucket->replacements[0], i * sizeof(DhtNode));
+
+    DhtNode *node = &bucket->replacements[0];
+    node->timestamp = g_get_monotonic_time();
+    node->is_alive = TRUE;
+    node->addr = *addr;
+    node->id = *id;
+    node->srtt = node->rttvar = 0;
+    dht_node_sample_rtt(node, rtt);
+}
+
+static void dht_bucket_forget(DhtBucket *bucket, const DhtId *id, const DhtAddress *addr)
+{
+    // Any address matches when addr is NULL
+    guint i;
+    for(i = 0; i < bucket->num_replacements; i++)
+    {
+        DhtNode *node = &bucket->replacements[i];
+        if(dht_id_equal(&node->id, id) && (!addr || dht_address_equal(&node->addr, addr)))
+        {
+            bucket->num_replacements--;
+            memmove(node, node + 1, (bucket->num_replacements - i) * sizeof(DhtNode));
+            return;
+        }
+    }
+}
+
+static gboolean dht_bucket_promote(DhtBucket *bucket, DhtNode *node)
+{
+    // Drop replacements already present in the bucket, except in the slot being filled
+    guint i = 0;
+    while(i < bucket->num_replacements)
+    {
+        DhtNode *other;
+        for(other = bucket->nodes; other < bucket->nodes + bucket->num_nodes; other++)
+        {
+            if((other != node) && dht_id_equal(&other->id, &bucket->replacements[i].id))
+                break;
+        }
+
+        if(other < bucket->nodes + bucket->num_nodes)
+        {
+            bucket->num_replacements--;
+            memmove(&bucket->replacements[i], &bucket->replacements[i + 1], (bucket->num_replacements - i) * sizeof(DhtNode));
+        }
+        else i++;
+    }
+
+    if(bucket->num_replacements == 0)
+        return FALSE;
+
+    // Prefer the fastest measured replacement, otherwise the most recently seen
+    guint best = 0;
+    for(i = 1; i < bucket->num_replacements; i++)
+    {
+        gint64 srtt = bucket->replacements[i].srtt;
+        if(srtt && (!bucket->replacements[best].srtt || (srtt < bucket->replacements[best].srtt)))
+            best = i;
+    }
+
+    *node = bucket->replacements[best];
+    bucket->num_replacements--;
+    memmove(&bucket->replacements[best], &bucket->replacements[best + 1], (bucket->num_replacements - best) * sizeof(DhtNode));
+    return TRUE;
+}
+
+static void dht_bucket_refill(DhtClient *client, DhtBucket *bucket)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    while((bucket->num_nodes < priv->node_count) && dht_bucket_promote(bucket, &bucket->nodes[bucket->num_nodes]))
+    {
+        bucket->num_nodes++;
+
+        priv->num_peers++;
+        dht_client_notify_peers(client);
+    }
+}
+
+static guint dht_client_search(DhtClient *client, const DhtId *id, MsgNode *nodes)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    return dht_table_search(priv->buckets, priv->num_buckets, priv->symbol_bits, priv->node_count, priv->linger_us, &priv->id, id, nodes);
+}
+
+static guint dht_table_search(const DhtBucket *buckets, guint num_buckets, guint symbol_bits, guint node_count, gint64 linger_us, const DhtId *self, const DhtId *id, MsgNode *nodes)
+{
+    DhtId metric;
+    dht_id_xor(&metric, self, id);
+
+    gint64 timestamp = g_get_monotonic_time();
+    gint nbits, first = MIN(dht_id_prefix_len(&metric), num_buckets - 1);
+    guint i, count = 0, symbols = 1 << (symbol_bits - 1);
+    guint size = dht_table_size(num_buckets, symbol_bits);
+
+    // Nodes in the target bucket are closest, followed by all deeper buckets
+    DhtId metrics[DHT_NODE_COUNT_MAX];
+    for(i = first * symbols; i < size; i++)
+        count = dht_bucket_select(&buckets[i], id, timestamp, linger_us, nodes, metrics, count, node_count);
+
+    // Shallower buckets are strictly further with decreasing prefix length
+    for(nbits = first - 1; (nbits >= 0) && (count < node_count); nbits--)
+    {
+        for(i = nbits * symbols; i < (nbits + 1) * symbols; i++)
+            count = dht_bucket_select(&buckets[i], id, timestamp, linger_us, nodes, metrics, count, node_count);
+    }
+
+    return count;
+}
+
+
+static guint dht_table_index(guint num_buckets, guint symbol_bits, const DhtId *metric)
+{
+    guint nbits = MIN(dht_id_prefix_len(metric), num_buckets - 1);
+    guint i, symbol = 0;
+
+    // The tail is not split by symbol, it covers our own ID
+    if(nbits < num_buckets - 1)
+    {
+        for(i = nbits + 1; i < nbits + symbol_bits; i++)
+            symbol = (symbol << 1) | ((i < DHT_ID_SIZE * 8) && (metric->data[i / 8] & (0x80 >> (i % 8))));
+    }
+
+    return (nbits << (symbol_bits - 1)) | symbol;
+}
+
+static guint dht_table_size(guint num_buckets, guint symbol_bits)
+{
+    // Every prefix length but the tail holds one bucket per symbol
+    return ((num_buckets - 1) << (symbol_bits - 1)) + 1;
+}
+
+static void dht_client_alloc_table(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    g_free(priv->buckets);
+    g_free(priv->storage);
+    priv->buckets = g_new0(DhtBucket, DHT_BUCKET_COUNT << (priv->symbol_bits - 1));
+    priv->storage = NULL;
+    dht_client_grow_table(client);
+}
+
+static void dht_client_grow_table(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Buckets in use get a slice sized by the configured node and replacement counts, node pointers move
+    guint i, size = dht_table_size(priv->num_buckets, priv->symbol_bits);
+    guint stride = priv->node_count + priv->replacement_count;
+    priv->storage = g_renew(DhtNode, priv->storage, size * stride);
+
+    for(i = 0; i < size; i++)
+    {
+        priv->buckets[i].nodes = priv->storage + i * stride;
+        priv->buckets[i].replacements = priv->buckets[i].nodes + priv->node_count;
+    }
+}
+
+static void dht_client_relayout(DhtClient *client, guint symbol_bits, guint node_count, guint replacement_count)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Collect live nodes from the old layout, then replacements least recent first
+    guint i, count = 0, size = dht_table_size(priv->num_buckets, priv->symbol_bits);
+    g_autofree DhtNode *nodes = g_new(DhtNode, priv->num_peers + size * priv->replacement_count);
+    for(i = 0; i < size; i++)
+    {
+        DhtBucket *bucket = &priv->buckets[i];
+
+        DhtNode *node;
+        for(node = bucket->nodes; node < bucket->nodes + bucket->num_nodes; node++)
+        {
+            if(node->is_alive)
+                nodes[count++] = *node;
         }
+    }
+
+    for(i = 0; i < size; i++)
+    {
+        DhtBucket *bucket = &priv->buckets[i];
+
+        DhtNode *node;
+        for(node = bucket->replacements + bucket->num_replacements; node > bucket->replacements; node--)
+            nodes[count++] = node[-1];
+    }
+
+    g_debug("Routing %u bits per step with %u nodes and %u replacements per bucket", symbol_bits, node_count, replacement_count);
+    priv->symbol_bits = symbol_bits;
+    priv->node_count = node_count;
+    priv->replacement_count = replacement_count;
+    priv->num_buckets = 1;
+    priv->num_peers = 0;
+    dht_client_alloc_table(client);
+
+    // Nodes beyond a smaller k become replacements, the most recent replacements are reinserted last
+    for(i = 0; i < count; i++)
+        dht_client_update(client, &nodes[i].id, &nodes[i].addr, TRUE, nodes[i].srtt);
+
+    priv->snapshot_dirty = TRUE;
+    dht_client_notify_peers(client);
+}
+
+static void dht_socket_set_buffers(GSocket *socket, guint size)
+{
+    if(size == 0) return;
+
+    // Larger kernel queues absorb request bursts between main loop wakeups
+    g_autoptr(GError) error = NULL;
+    if(!g_socket_set_option(socket, SOL_SOCKET, SO_RCVBUF, size, &error) || !g_socket_set_option(socket, SOL_SOCKET, SO_SNDBUF, size, &error))
+        g_debug("%s", error->message);
+}
+
+static void dht_client_publish(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    guint i, num_nodes = 0, size = dht_table_size(priv->num_buckets, priv->symbol_bits);
+    for(i = 0; i < size; i++)
+        num_nodes += priv->buckets[i].num_nodes;
+
+    DhtSnapshot *snapshot = g_malloc(sizeof(DhtSnapshot) + size * sizeof(DhtBucket) + num_nodes * sizeof(DhtNode));
+    snapshot->ref_count = 1;
+    snapshot->num_buckets = priv->num_buckets;
+    snapshot->symbol_bits = priv->symbol_bits;
+    snapshot->node_count = priv->node_count;
+    snapshot->linger_us = priv->linger_us;
+
+    // Workers only search nodes, replacements stay out of the copy
+    DhtNode *nodes = (DhtNode*)(snapshot->buckets + size);
+    for(i = 0; i < size; i++)
+    {
+        const DhtBucket *bucket = &priv->buckets[i];
+        memcpy(nodes, bucket->nodes, bucket->num_nodes * sizeof(DhtNode));
+        snapshot->buckets[i] = (DhtBucket) { nodes, bucket->num_nodes, NULL, 0, bucket->timestamp };
+        nodes += bucket->num_nodes;
+    }
+
+    // Readers keep their reference to the previous copy until done
+    g_mutex_lock(&priv->snapshot_mutex);
+    DhtSnapshot *previous = priv->snapshot;
+    priv->snapshot = snapshot;
+    g_mutex_unlock(&priv->snapshot_mutex);
+
+    if(previous) dht_snapshot_unref(previous);
+    priv->snapshot_dirty = FALSE;
+}
+
+static DhtSnapshot* dht_snapshot_ref(DhtSnapshot *snapshot)
+{
+    g_atomic_int_inc(&snapshot->ref_count);
+    return snapshot;
+}
+
+static void dht_snapshot_unref(DhtSnapshot *snapshot)
+{
+    if(g_atomic_int_dec_and_test(&snapshot->ref_count))
+        g_free(snapshot);
+}
+
+static DhtReceiver* dht_receiver_new(void)
+{
+    DhtReceiver *receiver = g_new(DhtReceiver, 1);
+
+#ifdef HAVE_RECVMMSG
+    guint i;
+    for(i = 0; i < MSG_BATCH_COUNT; i++)
+    {
+        receiver->vectors[i].iov_base = receiver->buffers[i];
+        receiver->vectors[i].iov_len = MSG_MTU;
+
+        memset(&receiver->messages[i].msg_hdr, 0, sizeof(struct msghdr));
+        receiver->messages[i].msg_hdr.msg_iov = &receiver->vectors[i];
+        receiver->messages[i].msg_hdr.msg_iovlen = 1;
+        receiver->messages[i].msg_hdr.msg_name = &receiver->natives[i];
+    }
+#endif /* HAVE_RECVMMSG */
+
+    return receiver;
+}
+
+static guint dht_receiver_receive(DhtReceiver *receiver, GSocket *socket)
+{
+    guint i, count = 0;
+#ifdef HAVE_RECVMMSG
+    // Drain pending datagrams with a single system call
+    for(i = 0; i < MSG_BATCH_COUNT; i++)
+        receiver->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+
+    gint res = recvmmsg(g_socket_get_fd(socket), receiver->messages, MSG_BATCH_COUNT, MSG_DONTWAIT, NULL);
+    if(res < 0)
+    {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK)) g_debug("%s", g_strerror(errno));
+        return 0;
+    }
+
+    for(count = 0; count < (guint)res; count++)
+    {
+        gboolean is_valid = dht_address_from_native(&receiver->addrs[count], &receiver->natives[count], receiver->messages[count].msg_hdr.msg_namelen);
+        receiver->lens[count] = is_valid ? (gssize)receiver->messages[count].msg_len : -1;
+    }
+#else
+    // Drain pending datagrams without returning to the main loop
+    for(i = 0; i < MSG_BATCH_COUNT; i++)
+    {
+        struct sockaddr_storage native;
+        socklen_t native_len = sizeof(native);
+        gssize len = recvfrom(g_socket_get_fd(socket), receiver->buffers[i], MSG_MTU, MSG_DONTWAIT, (struct sockaddr*)&native, &native_len);
+        if(len < 0)
+        {
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK)) g_debug("%s", g_strerror(errno));
+            break;
+        }
+
+        gboolean is_valid = dht_address_from_native(&receiver->addrs[i], &native, native_len);
+        receiver->lens[i] = is_valid ? len : -1;
+        count++;
+    }
+#endif /* HAVE_RECVMMSG */
+
+    return count;
+}
+
+static void dht_client_connect(DhtClient *client, const DhtId *id, const DhtAddress *addr, GSimpleAsyncResult *result)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Create connection
+    DhtConnection *connection = g_slice_new(DhtConnection);
+    connection->client = client;
+    connection->id = *id;
+    dht_key_make_random(&connection->nonce);
+    connection->is_remote = FALSE;
+    connection->socket = NULL;
+    connection->sockaddr = dht_address_deserialize(addr);
+    connection->result = result;
+    connection->has_cookie = FALSE;
+    connection->num_retries = 0;
+    dht_timer_init(&connection->timer, priv->timer_wheel, dht_connection_timeout_cb, connection);
+    dht_timer_start(&connection->timer, DHT_TIMEOUT_MS); // includes a remote key exchange, not adaptive
+    g_hash_table_replace(priv->connection_table, &connection->nonce, connection);
+
+    dht_connection_request(connection);
+}
+
+static void dht_connection_request(DhtConnection *connection)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(connection->client);
+
+    guint8 request[sizeof(MsgConnection1) + DHT_COOKIE_SIZE];
+    MsgConnection1 *msg = (MsgConnection1*)request;
+    msg->type = MSG_CONNECTION_REQ;
+    msg->pubkey = priv->pubkey;
+    msg->nonce = connection->nonce;
+    if(connection->has_cookie) memcpy(msg->cookie, connection->cookie, DHT_COOKIE_SIZE);
+
+    DhtAddress addr;
+    dht_address_serialize(&addr, connection->sockaddr);
+    dht_client_send(connection->client, &addr, request, sizeof(MsgConnection1) + (connection->has_cookie ? DHT_COOKIE_SIZE : 0));
+}
+
+static void dht_client_accept(DhtClient *client, const DhtId *id, const DhtAddress *addr, const DhtKey *peer_nonce, const DhtKey *shared)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    g_autoptr(GError) error = NULL;
+
+    GSocket *connection_socket = g_socket_new(DHT_ADDRESS_FAMILY, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
+    if(error)
+    {
+        g_debug("%s", error->message);
+        return;
+    }
+
+    MsgConnection2 response;
+    response.type = MSG_CONNECTION_RES;
+    response.pubkey = priv->pubkey;
+    response.peer_nonce = *peer_nonce;
+    dht_key_make_random(&response.nonce);
+
+    // Create connection
+    DhtConnection *connection = g_slice_new(DhtConnection);
+    dht_key_derive(&connection->enc_key, &response.auth_tag, shared, &response.nonce, peer_nonce);
+    dht_key_derive(&connection->dec_key, &connection->auth_tag, shared, peer_nonce, &response.nonce);
+    connection->nonce = response.nonce;
+    connection->client = client;
+    connection->id = *id;
+    connection->is_remote = TRUE;
+    connection->result = NULL;
+    connection->sockaddr = NULL;
+    connection->socket = connection_socket;
+    connection->has_cookie = FALSE;
+    connection->num_retries = 0;
+    dht_timer_init(&connection->timer, priv->timer_wheel, dht_connection_timeout_cb, connection);
+    dht_timer_start(&connection->timer, DHT_TIMEOUT_MS); // includes a remote key exchange, not adaptive
+    g_hash_table_replace(priv->connection_table, &connection->nonce, connection);
+
+    // Send response
+    g_autoptr(GSocketAddress) sockaddr = dht_address_deserialize(addr);
+    g_socket_send_to(connection_socket, sockaddr, (gchar*)&response, sizeof(MsgConnection2), NULL, &error);
+    if(error) g_debug("%s", error->message);
+}
+
+static void dht_client_offload(DhtClient *client, const DhtId *id, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *peer_nonce)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Initiator resends the request after its timeout, up to DHT_CONNECTION_RETRIES times
+    if(priv->num_handshakes >= DHT_CRYPTO_PENDING)
+    {
+        priv->stats.handshakes_dropped++;
+        return;
+    }
+
+    DhtHandshake *handshake = g_slice_new(DhtHandshake);
+    handshake->id = *id;
+    handshake->addr = *addr;
+    handshake->pubkey = *pubkey;
+    handshake->peer_nonce = *peer_nonce;
+    handshake->client = client;
+
+    priv->num_handshakes++;
+    priv->stats.handshakes_offloaded++;
+    g_thread_pool_push(priv->crypto_pool, handshake, NULL);
+}
+
+static void dht_client_remember_peer(DhtClient *client, const DhtId *id, const DhtAddress *addr)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtPeer *peer;
+    GList *link = g_hash_table_lookup(priv->peer_table, id);
+    if(link)
+    {
+        g_queue_unlink(priv->peer_queue, link);
+        peer = link->data;
+    }
+    else
+    {
+        // Evict least recently used peer
+        if(g_queue_get_length(priv->peer_queue) >= DHT_PEER_COUNT)
+        {
+            GList *last = g_queue_pop_tail_link(priv->peer_queue);
+            g_hash_table_remove(priv->peer_table, &((DhtPeer*)last->data)->id);
+            dht_peer_destroy_cb(last->data);
+            g_list_free_1(last);
+        }
+
+        peer = g_slice_new(DhtPeer);
+        peer->id = *id;
+        link = g_list_alloc();
+        link->data = peer;
+        g_hash_table_insert(priv->peer_table, &peer->id, link);
+    }
+
+    peer->addr = *addr;
+    peer->timestamp = g_get_monotonic_time();
+    g_queue_push_head_link(priv->peer_queue, link);
+}
+
+static const DhtAddress* dht_client_find_peer(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    GList *link = g_hash_table_lookup(priv->peer_table, id);
+    if(!link) return NULL;
+
+    DhtPeer *peer = link->data;
+    if(g_get_monotonic_time() - peer->timestamp > DHT_PEER_TTL_US)
+    {
+        dht_client_forget_peer(client, id);
+        return NULL;
+    }
+
+    // Mark as most recently used
+    g_queue_unlink(priv->peer_queue, link);
+    g_queue_push_head_link(priv->peer_queue, link);
+    return &peer->addr;
+}
+
+static void dht_client_forget_peer(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    GList *link = g_hash_table_lookup(priv->peer_table, id);
+    if(!link) return;
+
+    DhtPeer *peer = link->data;
+    g_hash_table_remove(priv->peer_table, id);
+    g_queue_delete_link(priv->peer_queue, link);
+    dht_peer_destroy_cb(peer);
+}
+
+static void dht_client_send(DhtClient *client, const DhtAddress *addr, gconstpointer data, gsize len)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    if(priv->num_send_packets == MSG_BATCH_COUNT)
+        dht_client_flush(client);
+
+    DhtPacket *packet = &priv->send_packets[priv->num_send_packets++];
+    packet->addr = *addr;
+    packet->len = len;
+    memcpy(packet->data, data, len);
+}
+
+static void dht_client_flush(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    guint i, count = priv->num_send_packets;
+    if(count == 0) return;
+    priv->num_send_packets = 0;
+
+#ifdef HAVE_SENDMMSG
+    for(i = 0; i < count; i++)
+    {
+        DhtPacket *packet = &priv->send_packets[i];
+        priv->send_messages[i].msg_hdr.msg_namelen = dht_address_to_native(&packet->addr, &priv->send_addresses[i], sizeof(priv->send_addresses[i]));
+        priv->send_vectors[i].iov_len = packet->len;
+    }
+
+    // Send all queued datagrams with a single system call
+    for(i = 0; i < count;)
+    {
+        gint res = sendmmsg(g_socket_get_fd(priv->socket), priv->send_messages + i, count - i, 0);
+        if(res > 0)
+        {
+            i += res;
+            continue;
+        }
+
+        // Skip datagram that failed
+        if(errno != EINTR)
+        {
+            g_debug("%s", g_strerror(errno));
+            i++;
+        }
+    }
+#else
+    for(i = 0; i < count; i++)
+    {
+        DhtPacket *packet = &priv->send_packets[i];
+
+        struct sockaddr_storage native;
+        socklen_t native_len = dht_address_to_native(&packet->addr, &native, sizeof(native));
+        if(sendto(g_socket_get_fd(priv->socket), packet->data, packet->len, 0, (struct sockaddr*)&native, native_len) < 0)
+            g_debug("%s", g_strerror(errno));
+    }
+#endif /* HAVE_SENDMMSG */
+}
+
+static DhtLookup* dht_lookup_new(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtLookup *lookup = g_slice_new(DhtLookup);
+    lookup->client = client;
+    lookup->id = *id;
+    lookup->num_sources = 0;
+    lookup->num_hedged = 0;
+    lookup->num_hedges = 0;
+    lookup->num_queries = 0;
+    lookup->num_timeouts = 0;
+    lookup->is_filling = FALSE;
+    lookup->concurrency = CLAMP(priv->concurrency, priv->min_concurrency, MAX(priv->min_concurrency, priv->max_concurrency));
+    lookup->max_concurrency = lookup->concurrency;
+    lookup->num_candidates = 0;
+    memset(lookup->seen, 0, sizeof(lookup->seen));
+    lookup->results = NULL;
+    lookup->probes = NULL;
+
+    // Callers join a running lookup instead, replacing it would leave its results and probes dangling
+    g_hash_table_replace(priv->lookup_table, &lookup->id, lookup);
+    dht_client_touch(client, id);
+
+    return lookup;
+}
+
+static guint dht_lookup_hash(const DhtAddress *addr)
+{
+    guint64 value = 0;
+    memcpy(&value, addr->data, DHT_ADDRESS_SIZE);
+    return (value * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)) >> (64 - DHT_SEEN_BITS);
+}
+
+static guint dht_lookup_search(DhtLookup *lookup, const DhtId *metric, guint count)
+{
+    guint low = 0, high = count;
+    while(low < high)
+    {
+        guint mid = (low + high) / 2;
+        if(dht_id_compare(&lookup->queries[lookup->order[mid]].metric, metric, NULL) < 0) low = mid + 1;
+        else high = mid;
+    }
+
+    return low;
+}
+
+static void dht_lookup_forget(DhtLookup *lookup, guint index)
+{
+    const guint mask = (1 << DHT_SEEN_BITS) - 1;
+    guint i = dht_lookup_hash(&lookup->queries[index].addr);
+    while(lookup->seen[i] != index + 1) i = (i + 1) & mask;
+
+    // Shift back following entries of the probe sequence
+    guint j = i;
+    while(lookup->seen[j = (j + 1) & mask])
+    {
+        guint k = dht_lookup_hash(&lookup->queries[lookup->seen[j] - 1].addr);
+        if((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+
+        lookup->seen[i] = lookup->seen[j];
+        i = j;
+    }
+
+    lookup->seen[i] = 0;
+}
+
+static DhtQuery* dht_lookup_find(DhtLookup *lookup, const DhtAddress *addr)
+{
+    const guint mask = (1 << DHT_SEEN_BITS) - 1;
+    guint i = dht_lookup_hash(addr);
+    for(; lookup->seen[i]; i = (i + 1) & mask)
+    {
+        DhtQuery *query = &lookup->queries[lookup->seen[i] - 1];
+        if(dht_address_equal(&query->addr, addr)) return query;
+    }
+
+    return NULL;
+}
+
+static DhtQuery* dht_lookup_insert(DhtLookup *lookup, const DhtId *metric, const DhtAddress *addr)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(lookup->client);
+
+    guint index, pos = dht_lookup_search(lookup, metric, lookup->num_candidates);
+    if(lookup->num_candidates < DHT_SHORTLIST_COUNT)
+    {
+        index = lookup->num_candidates;
+    }
+    else
+    {
+        // Evict the farthest never queried candidate behind the position
+        guint i = DHT_SHORTLIST_COUNT;
+        while((i > pos) && (lookup->queries[lookup->order[i - 1]].timestamp != 0)) i--;
+
+        // Otherwise the farthest finished one outside the k closest, it can no longer be part of the result
+        if(i == pos)
+        {
+            guint first = MAX(pos, priv->node_count);
+            i = DHT_SHORTLIST_COUNT;
+            while((i > first) && !lookup->queries[lookup->order[i - 1]].is_finished) i--;
+            if(i == first) return NULL;
+        }
+
+        index = lookup->order[i - 1];
+        dht_lookup_forget(lookup, index);
+        memmove(&lookup->order[i - 1], &lookup->order[i], DHT_SHORTLIST_COUNT - i);
+        lookup->num_candidates--;
+    }
+
+    memmove(&lookup->order[pos + 1], &lookup->order[pos], lookup->num_candidates - pos);
+    lookup->order[pos] = index;
+    lookup->num_candidates++;
+
+    DhtQuery *query = &lookup->queries[index];
+    query->lookup = lookup;
+    query->metric = *metric;
+    query->addr = *addr;
+    query->is_alive = FALSE;
+    query->is_finished = FALSE;
+    query->is_hedged = FALSE;
+    query->timestamp = 0;
+    query->timeout_remaining = 0;
+    dht_timer_init(&query->timer, priv->timer_wheel, dht_query_timeout_cb, query);
+
+    const guint mask = (1 << DHT_SEEN_BITS) - 1;
+    guint i = dht_lookup_hash(addr);
+    while(lookup->seen[i]) i = (i + 1) & mask;
+    lookup->seen[i] = index + 1;
+
+    return query;
+}
+
+static void dht_lookup_sort(DhtLookup *lookup, DhtQuery *query)
+{
+    guint index = query - lookup->queries;
+    guint pos = 0, count = lookup->num_candidates - 1;
+    while(lookup->order[pos] != index) pos++;
+    memmove(&lookup->order[pos], &lookup->order[pos + 1], count - pos);
+
+    pos = dht_lookup_search(lookup, &query->metric, count);
+    memmove(&lookup->order[pos + 1], &lookup->order[pos], count - pos);
+    lookup->order[pos] = index;
+}
+
+static void dht_lookup_update(DhtLookup *lookup, const MsgNode *nodes, guint count)
+{
+    DhtClient *client = lookup->client;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    while(count--)
+    {
+        const MsgNode *node = nodes++;
+
+        // Skip own ID
+        if(dht_id_equal(&node->id, &priv->id))
+            continue;
+
+        // Check if this is the target node
+        if(dht_id_equal(&node->id, &lookup->id))
+        {
+            dht_client_remember_peer(client, &node->id, &node->addr);
+            dht_lookup_resolve(lookup, &node->addr);
+            while(lookup->results)
+            {
+                GSimpleAsyncResult *result = lookup->results->data;
+                lookup->results = g_slist_delete_link(lookup->results, lookup->results);
+                dht_client_connect(client, &lookup->id, &node->addr, result);
+            }
+
+            dht_lookup_finish(lookup);
+            return;
+        }
+
+        if(!dht_lookup_find(lookup, &node->addr))
+        {
+            DhtId metric;
+            dht_id_xor(&metric, &lookup->id, &node->id);
+
+            // Insert query, dropped if farther than a full shortlist
+            dht_lookup_insert(lookup, &metric, &node->addr);
+        }
+    }
+
+    dht_lookup_dispatch(lookup);
+}
+
+static gint64 dht_lookup_rtt(DhtLookup *lookup, const DhtQuery *query)
+{
+    DhtId id;
+    dht_id_xor(&id, &query->metric, &lookup->id);
+
+    // Unmeasured nodes rank after measured ones
+    DhtNode *node = dht_client_find(lookup->client, &id);
+    return (node && node->srtt && dht_address_equal(&node->addr, &query->addr)) ? node->srtt : G_MAXINT64;
+}
+
+static DhtQuery* dht_lookup_select(DhtLookup *lookup, guint first)
+{
+    DhtQuery *best = &lookup->queries[lookup->order[first]];
+    guint nbits = dht_id_prefix_len(&best->metric);
+    gint64 best_rtt = dht_lookup_rtt(lookup, best);
+
+    // Sorted candidates with the same metric prefix length are equally close in bucket terms
+    guint i;
+    for(i = first + 1; i < lookup->num_candidates; i++)
+    {
+        DhtQuery *query = &lookup->queries[lookup->order[i]];
+        if(dht_id_prefix_len(&query->metric) != nbits)
+            break;
+
+        if(query->is_finished || dht_timer_is_active(&query->timer))
+            continue;
+
+        gint64 rtt = dht_lookup_rtt(lookup, query);
+        if(rtt < best_rtt)
+        {
+            best = query;
+            best_rtt = rtt;
+        }
+    }
+
+    return best;
+}
+
+static void dht_lookup_dispatch(DhtLookup *lookup)
+{
+    DhtClient *client = lookup->client;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    g_debug("Dispatch lookup %08x", dht_id_hash(&lookup->id));
+
+    guint i, num_alive = 0;
+    for(i = 0; (i < lookup->num_candidates) && (lookup->num_sources < lookup->concurrency) && (num_alive < priv->node_count); i++)
+    {
+        DhtQuery *query = &lookup->queries[lookup->order[i]];
+        if(!query->is_finished && !dht_timer_is_active(&query->timer))
+        {
+            if(lookup->is_filling && (priv->fill_requests >= priv->fill_budget))
+                break;
+
+            // Prefer the fastest idle candidate at the same distance
+            DhtQuery *selected = dht_lookup_select(lookup, i);
+
+            // Send request
+            MsgLookup request;
+            request.type = MSG_LOOKUP_REQ;
+            request.srcid = priv->id;
+            request.dstid = lookup->id;
+
+            dht_client_send(client, &selected->addr, &request, sizeof(MsgLookup));
+
+            DhtId id;
+            dht_id_xor(&id, &selected->metric, &lookup->id);
+
+            guint timeout = dht_client_timeout(client, &id);
+            guint hedge_delay = dht_client_hedge_delay(client);
+            selected->timestamp = g_get_monotonic_time();
+            lookup->num_sources++;
+            lookup->num_queries++;
+            if(lookup->is_filling) priv->fill_requests++;
+
+            if((hedge_delay > 0) && (hedge_delay < timeout) && (lookup->num_hedges < DHT_HEDGE_COUNT))
+            {
+                // Hedge slow request before it times out
+                selected->timeout_remaining = timeout - hedge_delay;
+                dht_timer_init(&selected->timer, priv->timer_wheel, dht_query_hedge_cb, selected);
+                dht_timer_start(&selected->timer, hedge_delay);
+            }
+            else
+            {
+                dht_timer_init(&selected->timer, priv->timer_wheel, dht_query_timeout_cb, selected);
+                dht_timer_start(&selected->timer, timeout);
+            }
+
+            // Revisit this candidate if another one was sent instead
+            if(selected != query)
+            {
+                i--;
+                continue;
+            }
+        }
+
+        if(query->is_alive) num_alive++;
+    }
+
+    if((lookup->num_sources == 0) && (lookup->num_hedged == 0))
+    {
+        dht_lookup_resolve(lookup, NULL);
+        while(lookup->results)
+        {
+            // Lookup failed, report error
+            GSimpleAsyncResult *result = lookup->results->data;
+            g_simple_async_result_set_error(result, G_IO_ERROR, G_IO_ERROR_HOST_NOT_FOUND, _("Lookup failed"));
+            g_simple_async_result_complete_in_idle(result);
+            g_object_unref(result);
+
+            lookup->results = g_slist_delete_link(lookup->results, lookup->results);
+        }
+
+        dht_lookup_finish(lookup);
+    }
+}
+
+static void dht_lookup_finish(DhtLookup *lookup)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(lookup->client);
+
+    // Fill the table once a self-lookup has found some peers
+    if(dht_id_equal(&lookup->id, &priv->id) && !priv->is_filling && !priv->is_filled && (priv->num_peers > 0) && (priv->fill_budget > 0))
+        dht_timer_start(&priv->fill_timer, 0);
+
+    g_hash_table_remove(priv->lookup_table, &lookup->id);
+}
+
+static void dht_lookup_adapt(DhtLookup *lookup, gboolean has_progress)
+{
+    DhtClient *client = lookup->client;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Widen on loss or stalled progress, narrow back on healthy responses
+    guint max_concurrency = MAX(priv->min_concurrency, priv->max_concurrency);
+    if(has_progress)
+        lookup->concurrency = MAX(lookup->concurrency - 1, priv->min_concurrency);
+    else
+        lookup->concurrency = MIN(MAX(lookup->concurrency, priv->min_concurrency) + 1, max_concurrency);
+
+    lookup->max_concurrency = MAX(lookup->max_concurrency, lookup->concurrency);
+}
+
+static void dht_lookup_resolve(DhtLookup *lookup, const DhtAddress *addr)
+{
+    DhtClient *client = lookup->client;
+
+    while(lookup->probes)
+    {
+        DhtProbe *probe = lookup->probes->data;
+        lookup->probes = g_slist_delete_link(lookup->probes, lookup->probes);
+        probe->lookups = g_slist_remove(probe->lookups, lookup);
+        probe->num_pending--;
+
+        if(addr) probe->num_found++;
+        if(probe->progress)
+        {
+            g_autoptr(GSocketAddress) sockaddr = addr ? dht_address_deserialize(addr) : NULL;
+            probe->progress(client, &lookup->id, sockaddr, probe->progress_data);
+        }
+
+        dht_probe_next(probe);
+    }
+}
+
+static DhtId* dht_lookup_siblings(DhtLookup *lookup, guint *count)
+{
+    GSList *iter, *link;
+    guint num_lookups = 0;
+    for(iter = lookup->probes; iter; iter = iter->next)
+        num_lookups += g_slist_length(((DhtProbe*)iter->data)->lookups);
+
+    *count = 0;
+    DhtId *ids = g_new(DhtId, num_lookups);
+    for(iter = lookup->probes; iter; iter = iter->next)
+    {
+        for(link = ((DhtProbe*)iter->data)->lookups; link; link = link->next)
+        {
+            if(link->data != lookup)
+                ids[(*count)++] = ((DhtLookup*)link->data)->id;
+        }
+    }
+
+    return ids;
+}
+
+static void dht_probe_next(DhtProbe *probe)
+{
+    DhtClient *client = probe->client;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Lookups resolving immediately re-enter through dht_lookup_resolve
+    if(probe->is_starting) return;
+    probe->is_starting = TRUE;
+
+    while((g_slist_length(probe->lookups) < DHT_PROBE_WINDOW) && (probe->next_target < probe->num_targets))
+    {
+        const DhtId *id = &probe->targets[probe->next_target++];
+
+        // Join a running lookup, no connection is made for probes
+        DhtLookup *lookup = g_hash_table_lookup(priv->lookup_table, id);
+        gboolean is_new = !lookup;
+        if(is_new) lookup = dht_lookup_new(client, id);
+
+        lookup->probes = g_slist_prepend(lookup->probes, probe);
+        probe->lookups = g_slist_prepend(probe->lookups, lookup);
+
+        if(is_new)
+        {
+            MsgNode nodes[DHT_NODE_COUNT_MAX];
+            guint i, count = dht_client_search(client, id, nodes);
+
+            // A lingering dead entry for the target is not a result, ask its neighbours instead
+            DhtNode *node = dht_client_find(client, id);
+            for(i = 0; node && !node->is_alive && (i < count); i++)
+            {
+                if(dht_id_equal(&nodes[i].id, id))
+                    nodes[i] = nodes[--count];
+            }
+
+            dht_lookup_update(lookup, nodes, count);
+        }
+    }
+
+    probe->is_starting = FALSE;
+    if(probe->num_pending == 0)
+    {
+        g_simple_async_result_set_op_res_gssize(probe->result, probe->num_found);
+        dht_probe_free(probe);
+    }
+}
+
+static gboolean dht_probe_start_cb(gpointer arg)
+{
+    DhtProbe *probe = arg;
+    DhtClient *client = probe->client;
+
+    probe->start_source = 0;
+    dht_probe_next(probe);
+    dht_client_flush(client);
+    return G_SOURCE_REMOVE;
+}
+
+static void dht_probe_free(DhtProbe *probe)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(probe->client);
+
+    if(probe->start_source > 0)
+        g_source_remove(probe->start_source);
+
+    priv->probes = g_slist_remove(priv->probes, probe);
+    g_simple_async_result_complete_in_idle(probe->result);
+    g_object_unref(probe->result);
+    g_slist_free(probe->lookups);
+    g_free(probe->targets);
+    g_slice_free(DhtProbe, probe);
+}
+
+static void dht_client_random_id(DhtClient *client, DhtId *id, guint index)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    guint nbits = index >> (priv->symbol_bits - 1);
+    guint symbol = index & ((1 << (priv->symbol_bits - 1)) - 1);
+
+    // Keep the first nbits of own ID
+    gint i, n = nbits;
+    for(i = 0; i < DHT_ID_SIZE; i++, n -= 8)
+    {
+        if(n >= 8)
+            id->data[i] = priv->id.data[i];
+        else if(n > 0)
+            id->data[i] = (priv->id.data[i] & (0xFF << (8 - n))) | g_random_int_range(0, 0xFF >> n);
+        else
+            id->data[i] = g_random_int_range(0, 0xFF);
+    }
+
+    // The tail covers any longer prefix
+    if(nbits == priv->num_buckets - 1)
+        return;
+
+    // Differ in the following bit to land in the bucket of that prefix length, then spell out the symbol
+    guint bit;
+    for(bit = nbits; (bit < nbits + priv->symbol_bits) && (bit < DHT_ID_SIZE * 8); bit++)
+    {
+        guint8 mask = 0x80 >> (bit % 8);
+        gboolean differs = (bit == nbits) || ((symbol >> (nbits + priv->symbol_bits - 1 - bit)) & 1);
+        id->data[bit / 8] = (id->data[bit / 8] & ~mask) | ((differs ? ~priv->id.data[bit / 8] : priv->id.data[bit / 8]) & mask);
+    }
+}
+
+static void dht_client_refresh(DhtClient *client, const DhtId *id, gboolean is_filling)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // A running lookup for the same ID covers the range already
+    if(g_hash_table_contains(priv->lookup_table, id))
+        return;
+
+    // Create lookup
+    DhtLookup *lookup = dht_lookup_new(client, id);
+    lookup->is_filling = is_filling;
+
+    // Dispatch lookup
+    MsgNode nodes[DHT_NODE_COUNT_MAX];
+    guint count = dht_client_search(client, &lookup->id, nodes);
+    dht_lookup_update(lookup, nodes, count);
+}
+
+static void dht_client_touch(DhtClient *client, const DhtId *id)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtId metric;
+    dht_id_xor(&metric, &priv->id, id);
+    priv->buckets[dht_table_index(priv->num_buckets, priv->symbol_bits, &metric)].timestamp = g_get_monotonic_time();
+}
+
+static void dht_client_refresh_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Refresh idle buckets only, busy ones are kept fresh by traffic
+    guint i;
+    gint64 timestamp = g_get_monotonic_time();
+    gint64 next = timestamp + priv->refresh_ms * 1000LL;
+    for(i = 0; i < dht_table_size(priv->num_buckets, priv->symbol_bits); i++)
+    {
+        DhtBucket *bucket = &priv->buckets[i];
+        if(timestamp - bucket->timestamp >= priv->refresh_idle_us)
+        {
+            DhtId id;
+            dht_client_random_id(client, &id, i);
+            dht_client_refresh(client, &id, FALSE);
+            priv->stats.bucket_refreshes++;
+        }
+
+        next = MIN(next, bucket->timestamp + priv->refresh_idle_us);
+    }
+
+    dht_client_flush(client);
+
+    if(priv->cache_file && (timestamp - priv->save_timestamp >= priv->refresh_ms * 1000LL))
+    {
+        // Written by GIO off the main loop
+        GBytes *bytes = dht_client_pack_nodes(client);
+        if(bytes)
+        {
+            g_autoptr(GFile) file = g_file_new_for_path(priv->cache_file);
+            g_file_replace_contents_bytes_async(file, bytes, NULL, FALSE, G_FILE_CREATE_NONE, priv->save_cancellable, dht_client_save_cb, NULL);
+            g_clear_pointer(&priv->saved_nodes, g_bytes_unref);
+            priv->saved_nodes = bytes;
+        }
+
+        priv->save_timestamp = timestamp;
+    }
+
+    // Wake up when the next bucket becomes idle, at least once per period
+    dht_timer_start(&priv->refresh_timer, MAX(next - timestamp, 0) / 1000 + 1);
+}
+
+static GBytes* dht_client_pack_nodes(DhtClient *client)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    guint i, count = 0, saved_count = priv->saved_nodes ? g_bytes_get_size(priv->saved_nodes) / sizeof(MsgNode) : 0;
+    MsgNode *nodes = g_new(MsgNode, priv->num_peers + saved_count);
+    for(i = 0; i < dht_table_size(priv->num_buckets, priv->symbol_bits); i++)
+    {
+        DhtBucket *bucket = &priv->buckets[i];
+
+        DhtNode *node;
+        for(node = bucket->nodes; node < bucket->nodes + bucket->num_nodes; node++)
+        {
+            if(!node->is_alive) continue;
+
+            nodes[count].id = node->id;
+            nodes[count].addr = node->addr;
+            count++;
+        }
+    }
+
+    // Keep the previous cache while offline, it is the only way back into the network
+    if(count == 0)
+    {
+        g_debug("No live nodes, keeping node cache");
+        g_free(nodes);
+        return NULL;
+    }
+
+    // Fill up to the previous size with saved nodes not in the table, a short outage must not shrink the cache
+    const MsgNode *saved = priv->saved_nodes ? g_bytes_get_data(priv->saved_nodes, NULL) : NULL;
+    for(i = 0; (i < saved_count) && (count < saved_count); i++)
+    {
+        if(!dht_client_find(client, &saved[i].id) && !dht_id_equal(&saved[i].id, &priv->id))
+            nodes[count++] = saved[i];
+    }
+
+    g_debug("Saving %u nodes", count);
+    return g_bytes_new_take(nodes, count * sizeof(MsgNode));
+}
+
+static void dht_client_save_cb(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    g_autoptr(GError) error = NULL;
+    if(!g_file_replace_contents_finish(G_FILE(source), result, NULL, &error) && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_debug("%s", error->message);
+}
+
+static void dht_client_fill_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    if(!priv->is_filling)
+    {
+        g_debug("Filling table from %u peers", priv->num_peers);
+        priv->is_filling = TRUE;
+        priv->fill_timestamp = g_get_monotonic_time();
+        priv->fill_requests = 0;
+        priv->fill_peers = 0;
+    }
+    else if(priv->num_peers <= priv->fill_peers)
+    {
+        // Previous round found nothing new, the table is as full as the network allows
+        priv->is_filling = FALSE;
+        priv->is_filled = TRUE;
+        priv->stats.fill_time_us = g_get_monotonic_time() - priv->fill_timestamp;
+        priv->stats.fill_requests = priv->fill_requests;
+        g_debug("Table filled with %u peers in %" G_GINT64_FORMAT " ms", priv->num_peers, priv->stats.fill_time_us / 1000);
+        return;
+    }
+
+    // Look up a random ID in the range of every bucket that has room left
+    priv->fill_peers = priv->num_peers;
+    guint i;
+    for(i = 0; i < dht_table_size(priv->num_buckets, priv->symbol_bits); i++)
+    {
+        if(priv->fill_requests >= priv->fill_budget)
+        {
+            g_debug("Table filling budget exhausted");
+            priv->fill_peers = G_MAXUINT;
+            break;
+        }
+
+        if(priv->buckets[i].num_nodes >= priv->node_count)
+            continue;
 
-        return;
+        DhtId id;
+        dht_client_random_id(client, &id, i);
+        dht_client_refresh(client, &id, TRUE);
     }
 
-    // Insert new node
-    DhtNode *node = g_slice_new(DhtNode);
-    node->timestamp = g_get_monotonic_time();
-    node->is_alive = TRUE;
-    node->addr = *addr;
-    node->id = *id;
+    dht_client_flush(client);
+    dht_timer_start(&priv->fill_timer, DHT_FILL_ROUND_MS);
+}
+
+static void dht_client_sweep_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
-    bucket->data = g_list_prepend(bucket->data, node);
-    count++;
+    guint i, num_peers = priv->num_peers;
+    gint64 timestamp = g_get_monotonic_time();
 
-    priv->num_peers++;
-    g_object_notify_by_pspec(G_OBJECT(client), dht_client_properties[PROP_PEERS]);
+    // Evict expired nodes
+    for(i = 0; i < dht_table_size(priv->num_buckets, priv->symbol_bits); i++)
+        dht_bucket_purge(client, &priv->buckets[i], timestamp);
 
-    // Split buckets
-    while((count == DHT_NODE_COUNT) && !bucket->next)
+    if(priv->num_peers != num_peers)
     {
-        GList *first = NULL, *last = NULL;
+        dht_client_merge(client);
+        priv->snapshot_dirty = TRUE;
+    }
 
-        count = 0;
-        link = bucket->data;
-        while(link)
-        {
-            // Redistribute nodes
-            GList *next = link->next;
-            DhtNode *node = link->data;
-            if(!((node->id.data[nbits / 8] ^ priv->id.data[nbits / 8]) & (0x80 >> nbits % 8)))
-            {
-                bucket->data = g_list_remove_link(bucket->data, link);
-                first = g_list_concat(last, link);
-                last = link;
-                count++;
-            }
+    dht_timer_start(&priv->sweep_timer, DHT_SWEEP_MS);
+}
 
-            link = next;
-        }
+static void dht_client_cookie_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
-        bucket = g_list_append(bucket, first)->next;
-        priv->num_buckets++;
-        nbits++;
-    }
+    // Cookies issued before the rotation stay valid for one more period
+    priv->cookie_secrets[1] = priv->cookie_secrets[0];
+    dht_key_make_random(&priv->cookie_secrets[0]);
 
-    return;
+    dht_timer_start(&priv->cookie_timer, DHT_COOKIE_MS);
 }
 
-static guint dht_client_search(DhtClient *client, const DhtId *id, MsgNode *nodes)
+static gboolean dht_client_notify_cb(gpointer arg)
 {
+    DhtClient *client = arg;
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
-    DhtId metric;
-    dht_id_xor(&metric, &priv->id, id);
+    priv->notify_source = 0;
+    g_object_notify_by_pspec(G_OBJECT(client), dht_client_properties[PROP_PEERS]);
+    return G_SOURCE_REMOVE;
+}
 
-    gint64 timestamp = g_get_monotonic_time();
-    guint count = 0, nbits = 0, dir = 1;
+static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    DhtReceiver *receiver = priv->receiver;
 
-    GList *bucket = priv->buckets;
-    while(bucket)
-    {
-        if(!(metric.data[nbits / 8] & (0x80 >> (nbits % 8))) == !dir)
-        {
-            // Iterate nodes
-            GList *link = bucket->data;
-            while(link)
-            {
-                GList *next = link->next;
-                DhtNode *node = link->data;
-                if(node->is_alive || (timestamp - node->timestamp < DHT_LINGER_US))
-                {
-                    // Copy alive node
-                    nodes->id = node->id;
-                    nodes->addr = node->addr;
-                    nodes++;
+    guint i, count = dht_receiver_receive(receiver, socket);
+    for(i = 0; i < count; i++)
+        dht_client_handle(client, &receiver->addrs[i], receiver->buffers[i], receiver->lens[i]);
 
-                    if(++count == DHT_NODE_COUNT)
-                        return count;
-                }
-                else
-                {
-                    g_debug("Delete node %08x", dht_id_hash(&node->id));
+    dht_client_flush(client);
+
+    priv->stats.receive_wakeups++;
+    priv->stats.receive_messages += count;
+    priv->stats.receive_batch_max = MAX(priv->stats.receive_batch_max, count);
+    return G_SOURCE_CONTINUE;
+}
 
-                    // Delete dead node
-                    g_slice_free(DhtNode, node);
-                    bucket->data = g_list_delete_link(bucket->data, link);
+static void dht_client_publish_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
-                    priv->num_peers--;
-                    g_object_notify_by_pspec(G_OBJECT(client), dht_client_properties[PROP_PEERS]);
-                }
+    if(priv->snapshot_dirty)
+        dht_client_publish(client);
 
-                link = next;
-            }
-        }
+    dht_timer_start(&priv->snapshot_timer, DHT_SNAPSHOT_MS);
+}
 
-        // Iterate buckets
-        if(dir)
+static gboolean dht_client_inbox_cb(gpointer arg)
+{
+    DhtClient *client = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtPacket *packet;
+    while((packet = g_async_queue_try_pop(priv->inbox)))
+    {
+        if((packet->data[0] == MSG_LOOKUP_REQ) && (packet->len == sizeof(MsgLookup)))
         {
-            if(bucket->next)
-            {
-                bucket = bucket->next;
-                nbits++;
-            }
-            else dir = 0;
+            // Already answered by the worker, only the sender is recorded
+            MsgLookup *msg = (MsgLookup*)packet->data;
+            if(!dht_id_equal(&msg->srcid, &priv->id))
+                dht_client_update(client, &msg->srcid, &packet->addr, TRUE, 0);
+
+            priv->stats.worker_requests++;
         }
-        else
+        else dht_client_handle(client, &packet->addr, packet->data, packet->len);
+
+        g_slice_free(DhtPacket, packet);
+    }
+
+    DhtHandshake *handshake;
+    while((handshake = g_async_queue_try_pop(priv->handshakes)))
+    {
+        priv->num_handshakes--;
+        if(handshake->is_valid)
         {
-            bucket = bucket->prev;
-            nbits--;
+            dht_key_cache_add_shared(priv->key_cache, &handshake->pubkey, &handshake->shared, handshake->elapsed);
+            if(priv->listen) dht_client_accept(client, &handshake->id, &handshake->addr, &handshake->peer_nonce, &handshake->shared);
         }
+
+        dht_handshake_free(handshake);
     }
 
-    return count;
+    dht_client_flush(client);
+    return G_SOURCE_CONTINUE;
 }
 
-static void dht_lookup_update(DhtLookup *lookup, const MsgNode *nodes, guint count)
+static gboolean dht_inbox_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
 {
-    DhtClient *client = lookup->client;
-    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    // Disarm before draining, workers re-arm after each push
+    g_source_set_ready_time(source, -1);
+    return callback(user_data);
+}
 
-    while(count--)
-    {
-        const MsgNode *node = nodes++;
+static gpointer dht_worker_thread(gpointer arg)
+{
+    DhtWorker *worker = arg;
 
-        // Skip own ID
-        if(dht_id_equal(&node->id, &priv->id))
-            continue;
+    g_main_context_push_thread_default(worker->context);
+    g_main_loop_run(worker->loop);
+    g_main_context_pop_thread_default(worker->context);
+    return NULL;
+}
 
-        // Check if this is the target node
-        if(dht_id_equal(&node->id, &lookup->id))
-        {
-            while(lookup->results)
-            {
-                GSimpleAsyncResult *result = lookup->results->data;
-                lookup->results = g_slist_delete_link(lookup->results, lookup->results);
+static gboolean dht_packet_is_valid(const guint8 *buffer, gssize len)
+{
+    // Same size checks as the handler, so workers never forward what it would ignore
+    switch(buffer[0])
+    {
+        case MSG_LOOKUP_REQ:
+            return len == sizeof(MsgLookup);
 
-                MsgConnection1 request;
-                request.type = MSG_CONNECTION_REQ;
-                request.pubkey = priv->pubkey;
-                dht_key_make_random(&request.nonce);
-
-                // Create connection
-                DhtConnection *connection = g_slice_new(DhtConnection);
-                connection->client = client;
-                connection->id = lookup->id;
-                connection->nonce = request.nonce;
-                connection->is_remote = FALSE;
-                connection->socket = NULL;
-                connection->sockaddr = dht_address_deserialize(&node->addr);
-                connection->result = result;
-                connection->timeout_source = g_timeout_add(DHT_TIMEOUT_MS, dht_connection_timeout_cb, connection);
-                g_hash_table_replace(priv->connection_table, &connection->nonce, connection);
-
-                // Send request
-                g_autoptr(GError) error = NULL;
-                g_socket_send_to(priv->socket, connection->sockaddr, (gchar*)&request, sizeof(MsgConnection1), NULL, &error);
-                if(error) g_debug("%s", error->message);
-            }
+        case MSG_LOOKUP_RES:
+            return (len >= sizeof(MsgLookup)) && ((len - sizeof(MsgLookup)) % sizeof(MsgNode) == 0);
 
-            g_hash_table_remove(priv->lookup_table, &lookup->id);
-            return;
-        }
+        case MSG_CONNECTION_REQ:
+            return (len == sizeof(MsgConnection1)) || (len == sizeof(MsgConnection1) + DHT_COOKIE_SIZE);
 
-        if(!g_hash_table_contains(lookup->query_table, &node->addr))
-        {
-            DhtId metric;
-            dht_id_xor(&metric, &lookup->id, &node->id);
+        case MSG_CONNECTION_RES:
+            return (len == sizeof(MsgConnection2)) || (len == sizeof(MsgConnection3));
 
-            // Insert query
-            DhtQuery *query = g_slice_new(DhtQuery);
-            query->lookup = lookup;
-            query->metric = metric;
-            query->addr = node->addr;
-            query->is_alive = FALSE;
-            query->is_finished = FALSE;
-            query->timeout_source = 0;
-
-            GSequenceIter *iter = g_sequence_search(lookup->query_sequence, query, dht_id_compare, NULL);
-            g_hash_table_insert(lookup->query_table, &query->addr, g_sequence_insert_before(iter, query));
-        }
-    }
+        case MSG_CONNECTION_COOKIE:
+            return len == sizeof(MsgCookie);
 
-    dht_lookup_dispatch(lookup);
+        default:
+            return FALSE;
+    }
 }
 
-static void dht_lookup_dispatch(DhtLookup *lookup)
+static gboolean dht_worker_receive_cb(GSocket *socket, GIOCondition condition, gpointer arg)
 {
-    DhtClient *client = lookup->client;
-    DhtClientPrivate *priv = dht_client_get_instance_private(client);
-    g_debug("Dispatch lookup %08x", dht_id_hash(&lookup->id));
+    DhtWorker *worker = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(worker->client);
+    DhtReceiver *receiver = worker->receiver;
+
+    guint i, count = dht_receiver_receive(receiver, socket);
+    if(count == 0) return G_SOURCE_CONTINUE;
+
+    g_mutex_lock(&priv->snapshot_mutex);
+    DhtSnapshot *snapshot = dht_snapshot_ref(priv->snapshot);
+    g_mutex_unlock(&priv->snapshot_mutex);
 
-    guint num_alive = 0;
-    GSequenceIter *iter = g_sequence_get_begin_iter(lookup->query_sequence);
-    while(!g_sequence_iter_is_end(iter) && (lookup->num_sources < DHT_CONCURRENCY) && (num_alive < DHT_NODE_COUNT))
+    for(i = 0; i < count; i++)
     {
-        DhtQuery *query = g_sequence_get(iter);
-        if(!query->is_finished && (query->timeout_source == 0))
+        guint8 *buffer = receiver->buffers[i];
+        gssize len = receiver->lens[i];
+        if(len < 1) continue;
+
+        gboolean is_request = (buffer[0] == MSG_LOOKUP_REQ) && (len == sizeof(MsgLookup));
+        if(is_request && !dht_source_admit(worker->sources, &receiver->addrs[i], g_get_monotonic_time()))
         {
-            // Send request
-            MsgLookup request;
-            request.type = MSG_LOOKUP_REQ;
-            request.srcid = priv->id;
-            request.dstid = lookup->id;
+            g_atomic_int_inc(&worker->requests_dropped);
+            continue;
+        }
 
-            g_autoptr(GError) error = NULL;
-            g_autoptr(GSocketAddress) sockaddr = dht_address_deserialize(&query->addr);
-            g_socket_send_to(priv->socket, sockaddr, (gchar*)&request, sizeof(MsgLookup), NULL, &error);
-            if(error) g_debug("%s", error->message);
+        if(!dht_packet_is_valid(buffer, len))
+            continue;
 
-            query->timeout_source = g_timeout_add(DHT_TIMEOUT_MS, dht_query_timeout_cb, query);
-            lookup->num_sources++;
+        // Shed load instead of queueing without bound when the main thread falls behind
+        if(g_async_queue_length(priv->inbox) >= DHT_INBOX_COUNT)
+        {
+            g_atomic_int_inc(&worker->inbox_dropped);
+            continue;
         }
 
-        if(query->is_alive) num_alive++;
-        iter = g_sequence_iter_next(iter);
-    }
+        // Everything touching client state is handled by the main thread
+        DhtPacket *packet = g_slice_new(DhtPacket);
+        packet->addr = receiver->addrs[i];
+        packet->len = len;
+        memcpy(packet->data, buffer, len);
+        g_async_queue_push(priv->inbox, packet);
 
-    if(lookup->num_sources == 0)
-    {
-        while(lookup->results)
-        {
-            // Lookup failed, report error
-            GSimpleAsyncResult *result = lookup->results->data;
-            g_simple_async_result_set_error(result, G_IO_ERROR, G_IO_ERROR_HOST_NOT_FOUND, _("Lookup failed"));
-            g_simple_async_result_complete_in_idle(result);
-            g_object_unref(result);
+        if(!is_request) continue;
 
-            lookup->results = g_slist_delete_link(lookup->results, lookup->results);
-        }
+        MsgLookup *msg = (MsgLookup*)buffer;
+        if(dht_id_equal(&msg->srcid, &priv->id))
+            continue;
+
+        // Answer from the snapshot without waiting for the main thread
+        msg->type = MSG_LOOKUP_RES;
+        msg->srcid = priv->id;
+        guint num_nodes = dht_table_search(snapshot->buckets, snapshot->num_buckets, snapshot->symbol_bits, snapshot->node_count, snapshot->linger_us, &priv->id, &msg->dstid, msg->nodes);
 
-        g_hash_table_remove(priv->lookup_table, &lookup->id);
+        struct sockaddr_storage native;
+        gsize native_len = dht_address_to_native(&receiver->addrs[i], &native, sizeof(native));
+        if(sendto(g_socket_get_fd(socket), buffer, sizeof(MsgLookup) + num_nodes * sizeof(MsgNode), 0, (struct sockaddr*)&native, native_len) < 0)
+            g_debug("%s", g_strerror(errno));
     }
+
+    dht_snapshot_unref(snapshot);
+    g_source_set_ready_time(priv->inbox_source, 0);
+    return G_SOURCE_CONTINUE;
 }
 
-static gboolean dht_client_refresh_cb(gpointer arg)
+static void dht_handshake_thread(gpointer data, gpointer user_data)
 {
-    DhtClient *client = arg;
-    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+    DhtHandshake *handshake = data;
+    DhtClientPrivate *priv = dht_client_get_instance_private(handshake->client);
 
-    // Create lookup
-    DhtLookup *lookup = g_slice_new(DhtLookup);
-    lookup->client = client;
-    lookup->num_sources = 0;
-    lookup->query_sequence = g_sequence_new(dht_query_destroy_cb);
-    lookup->query_table = g_hash_table_new(dht_address_hash, dht_address_equal);
-    lookup->results = NULL;
+    // Private key is immutable after construction
+    gint64 timestamp = g_get_monotonic_time();
+    handshake->is_valid = dht_key_make_shared(&handshake->shared, &priv->privkey, &handshake->pubkey);
+    handshake->elapsed = g_get_monotonic_time() - timestamp;
 
-    // Generate ID
-    gint i, nbits = g_random_int_range(0, priv->num_buckets);
-    for(i = 0; i < DHT_ID_SIZE; i++, nbits -= 8)
-    {
-        if(nbits >= 8)
-            lookup->id.data[i] = priv->id.data[i];
-        else if(nbits > 0)
-            lookup->id.data[i] = (priv->id.data[i] & (0xFF << (8 - nbits))) | g_random_int_range(0, 0xFF >> nbits);
-        else
-            lookup->id.data[i] = g_random_int_range(0, 0xFF);
-    }
+    g_async_queue_push(priv->handshakes, handshake);
+    g_source_set_ready_time(priv->inbox_source, 0);
+}
 
-    g_hash_table_replace(priv->lookup_table, &lookup->id, lookup);
+static void dht_handshake_free(DhtHandshake *handshake)
+{
+    // Shared secret lives in slice memory, wipe it before reuse
+    dht_key_wipe(&handshake->shared);
+    g_slice_free(DhtHandshake, handshake);
+}
 
-    // Dispatch lookup
-    MsgNode nodes[DHT_NODE_COUNT];
-    guint count = dht_client_search(client, &lookup->id, nodes);
-    dht_lookup_update(lookup, nodes, count);
+static gboolean dht_worker_quit_cb(gpointer arg)
+{
+    DhtWorker *worker = arg;
 
-    return G_SOURCE_CONTINUE;
+    g_main_loop_quit(worker->loop);
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, gpointer arg)
+static void dht_client_handle(DhtClient *client, const DhtAddress *addr, guint8 *buffer, gssize len)
 {
-    DhtClient *client = arg;
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
-
-    guint8 buffer[MSG_MTU];
-
     g_autoptr(GError) error = NULL;
-    g_autoptr(GSocketAddress) sockaddr = NULL;
-    gssize len = g_socket_receive_from(socket, &sockaddr, (gchar*)buffer, sizeof(buffer), NULL, &error);
-    if(error) g_debug("%s", error->message);
 
-    if(len < 1) return G_SOURCE_CONTINUE;
+    if(len < 1) return;
 
     switch(buffer[0])
     {
         case MSG_LOOKUP_REQ:
         {
             if(len != sizeof(MsgLookup)) break;
+            if(!dht_client_admit(client, addr)) break;
             MsgLookup *msg = (MsgLookup*)buffer;
 
             // Ignore own source ID
             if(dht_id_equal(&msg->srcid, &priv->id)) break;
 
-            DhtAddress addr;
-            dht_address_serialize(&addr, sockaddr);
-
             g_debug("Lookup request %08x -> %08x", dht_id_hash(&msg->srcid), dht_id_hash(&msg->dstid));
-            dht_client_update(client, &msg->srcid, &addr, TRUE);
+            dht_client_update(client, &msg->srcid, addr, TRUE, 0);
 
             // Send response
             msg->type = MSG_LOOKUP_RES;
             msg->srcid = priv->id;
             guint count = dht_client_search(client, &msg->dstid, msg->nodes);
-            g_socket_send_to(socket, sockaddr, (gchar*)buffer, sizeof(MsgLookup) + count * sizeof(MsgNode), NULL, &error);
-            if(error) g_debug("%s", error->message);
+            dht_client_send(client, addr, buffer, sizeof(MsgLookup) + count * sizeof(MsgNode));
             break;
         }
 
@@ -782,29 +3059,32 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
             // Ignore own source ID
             if(dht_id_equal(&msg->srcid, &priv->id)) break;
 
-            DhtAddress addr;
-            dht_address_serialize(&addr, sockaddr);
-
             g_debug("Lookup response %08x -> %08x", dht_id_hash(&msg->srcid), dht_id_hash(&msg->dstid));
-            dht_client_update(client, &msg->srcid, &addr, TRUE);
 
-            // Find lookup
+            // Find lookup and query
             DhtLookup *lookup = g_hash_table_lookup(priv->lookup_table, &msg->dstid);
-            if(!lookup) break;
+            DhtQuery *query = lookup ? dht_lookup_find(lookup, addr) : NULL;
 
-            // Find query
-            GSequenceIter *iter = g_hash_table_lookup(lookup->query_table, &addr);
-            if(!iter) break;
+            // Sample round-trip time of pending query
+            gint64 rtt = 0;
+            if(query && dht_timer_is_active(&query->timer))
+            {
+                rtt = g_get_monotonic_time() - query->timestamp;
+                dht_client_sample_rtt(client, rtt);
+            }
+
+            dht_client_update(client, &msg->srcid, addr, TRUE, rtt);
+            if(!query) break;
 
             // Update query
-            DhtQuery *query = g_sequence_get(iter);
             query->is_finished = TRUE;
             query->is_alive = TRUE;
-            if(query->timeout_source > 0)
+            if(dht_timer_is_active(&query->timer))
             {
-                g_source_remove(query->timeout_source);
-                query->timeout_source = 0;
-                lookup->num_sources--;
+                dht_timer_stop(&query->timer);
+
+                if(query->is_hedged) lookup->num_hedged--;
+                else lookup->num_sources--;
             }
 
             DhtId metric;
@@ -812,59 +3092,89 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
             if(!dht_id_equal(&metric, &query->metric))
             {
                 query->metric = metric;
-                g_sequence_sort_changed(iter, dht_id_compare, NULL);
+                dht_lookup_sort(lookup, query);
             }
 
+            // Check if response contains nodes closer than the best known
+            guint i;
+            gboolean has_progress = FALSE;
+            DhtId metrics[(MSG_MTU - sizeof(MsgLookup)) / sizeof(MsgNode)];
+            const DhtQuery *best = &lookup->queries[lookup->order[0]];
+            dht_id_xor_array(metrics, msg->nodes, sizeof(MsgNode), count, &lookup->id);
+            for(i = 0; (i < count) && !has_progress; i++)
+                has_progress = dht_id_compare(&metrics[i], &best->metric, NULL) < 0;
+
+            dht_lookup_adapt(lookup, has_progress);
+
+            // Collect sibling lookups first, the update may finish this one
+            guint num_siblings;
+            g_autofree DhtId *siblings = dht_lookup_siblings(lookup, &num_siblings);
+
             // Update lookup
             dht_lookup_update(lookup, msg->nodes, count);
+
+            // Nodes near one probe target are often near or equal to the others,
+            // only the response is shared, each sibling still queries its own candidates
+            for(i = 0; i < num_siblings; i++)
+            {
+                DhtLookup *sibling = g_hash_table_lookup(priv->lookup_table, &siblings[i]);
+                if(!sibling) continue;
+
+                priv->stats.probe_shared++;
+                dht_lookup_update(sibling, msg->nodes, count);
+            }
+
             break;
         }
 
         case MSG_CONNECTION_REQ:
         {
-            if(len != sizeof(MsgConnection1)) break;
+            if((len != sizeof(MsgConnection1)) && (len != sizeof(MsgConnection1) + DHT_COOKIE_SIZE)) break;
+            if(!dht_client_admit(client, addr)) break;
             MsgConnection1 *msg = (MsgConnection1*)buffer;
 
             DhtId id;
-            dht_id_from_pubkey(&id, &msg->pubkey);
+            dht_key_cache_get_id(priv->key_cache, &id, &msg->pubkey);
             if(dht_id_equal(&id, &priv->id)) break;
 
             g_debug("Connection request %08x", dht_id_hash(&id));
             if(priv->listen)
             {
-                DhtKey shared;
-                if(!dht_key_make_shared(&shared, &priv->privkey, &msg->pubkey)) break;
+                // Prove the source address before any state is created
+                if(priv->cookies)
+                {
+                    if(len == sizeof(MsgConnection1))
+                    {
+                        MsgCookie response;
+                        response.type = MSG_CONNECTION_COOKIE;
+                        response.peer_nonce = msg->nonce;
+                        dht_cookie_make(response.cookie, &priv->cookie_secrets[0], addr, &msg->pubkey, &msg->nonce);
+                        dht_client_send(client, addr, &response, sizeof(MsgCookie));
+                        priv->stats.cookies_sent++;
+                        break;
+                    }
+
+                    if(!dht_cookie_verify(msg->cookie, &priv->cookie_secrets[0], addr, &msg->pubkey, &msg->nonce) &&
+                       !dht_cookie_verify(msg->cookie, &priv->cookie_secrets[1], addr, &msg->pubkey, &msg->nonce))
+                    {
+                        priv->stats.cookies_rejected++;
+                        break;
+                    }
+                }
 
-                GSocket *connection_socket = g_socket_new(DHT_ADDRESS_FAMILY, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
-                if(error)
+                // Shared budget bounds the time spent on key exchange
+                if(!dht_rate_admit(&priv->handshake_deadline, g_get_monotonic_time(), G_USEC_PER_SEC / DHT_HANDSHAKE_RATE, DHT_HANDSHAKE_BURST))
                 {
-                    g_debug("%s", error->message);
+                    priv->stats.handshakes_dropped++;
                     break;
                 }
 
-                MsgConnection2 response;
-                response.type = MSG_CONNECTION_RES;
-                response.pubkey = priv->pubkey;
-                response.peer_nonce = msg->nonce;
-                dht_key_make_random(&response.nonce);
-
-                // Create connection
-                DhtConnection *connection = g_slice_new(DhtConnection);
-                dht_key_derive(&connection->enc_key, &response.auth_tag, &shared, &response.nonce, &msg->nonce);
-                dht_key_derive(&connection->dec_key, &connection->auth_tag, &shared, &msg->nonce, &response.nonce);
-                connection->nonce = response.nonce;
-                connection->client = client;
-                connection->id = id;
-                connection->is_remote = TRUE;
-                connection->result = NULL;
-                connection->sockaddr = NULL;
-                connection->socket = connection_socket;
-                connection->timeout_source = g_timeout_add(DHT_TIMEOUT_MS, dht_connection_timeout_cb, connection);
-                g_hash_table_replace(priv->connection_table, &connection->nonce, connection);
-
-                // Send response
-                g_socket_send_to(connection_socket, sockaddr, (gchar*)&response, sizeof(MsgConnection2), NULL, &error);
-                if(error) g_debug("%s", error->message);
+                // Key exchange runs on the crypto pool unless the secret is cached
+                DhtKey shared;
+                if(dht_key_cache_find_shared(priv->key_cache, &shared, &msg->pubkey))
+                    dht_client_accept(client, &id, addr, &msg->nonce, &shared);
+                else
+                    dht_client_offload(client, &id, addr, &msg->pubkey, &msg->nonce);
             }
 
             break;
@@ -877,15 +3187,27 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
                 MsgConnection2 *msg = (MsgConnection2*)buffer;
 
                 DhtId id;
-                dht_id_from_pubkey(&id, &msg->pubkey);
+                dht_key_cache_get_id(priv->key_cache, &id, &msg->pubkey);
                 g_debug("Connection response 1 %08x", dht_id_hash(&id));
 
                 // Find connection
                 DhtConnection *connection = g_hash_table_lookup(priv->connection_table, &msg->peer_nonce);
                 if(!connection || connection->is_remote || !dht_id_equal(&connection->id, &id)) break;
 
+                // Direct connection to cached peer, claim a pending result
+                DhtLookup *lookup = NULL;
+                if(!connection->result)
+                {
+                    lookup = g_hash_table_lookup(priv->lookup_table, &connection->id);
+                    if(!lookup || !lookup->results)
+                    {
+                        g_hash_table_remove(priv->connection_table, &connection->nonce);
+                        break;
+                    }
+                }
+
                 DhtKey shared;
-                if(!dht_key_make_shared(&shared, &priv->privkey, &msg->pubkey)) break;
+                if(!dht_key_cache_get_shared(priv->key_cache, &shared, &priv->privkey, &msg->pubkey)) break;
 
                 MsgConnection3 response;
                 response.type = MSG_CONNECTION_RES;
@@ -907,10 +3229,25 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
                 g_socket_send_to(connection->socket, connection->sockaddr, (gchar*)&response, sizeof(MsgConnection3), NULL, &error);
                 if(error) g_debug("%s", error->message);
 
-                g_source_remove(connection->timeout_source);
-                connection->timeout_source = 0;
+                dht_timer_stop(&connection->timer);
+
+                MsgNode node;
+                node.id = connection->id;
+                dht_address_serialize(&node.addr, connection->sockaddr);
+                dht_client_remember_peer(client, &node.id, &node.addr);
+
+                if(lookup)
+                {
+                    connection->result = lookup->results->data;
+                    lookup->results = g_slist_delete_link(lookup->results, lookup->results);
+
+                    // Connect remaining results directly, finishing the lookup
+                    if(lookup->results || lookup->probes) dht_lookup_update(lookup, &node, 1);
+                    else dht_lookup_finish(lookup);
+                }
 
                 // Complete result
+                g_autoptr(GSocketAddress) sockaddr = dht_address_deserialize(addr);
                 g_socket_connect(connection->socket, sockaddr, NULL, NULL);
                 g_hash_table_steal(priv->connection_table, &connection->nonce);
                 g_simple_async_result_set_op_res_gpointer(connection->result, connection, dht_connection_destroy_cb);
@@ -930,6 +3267,7 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
                 if(priv->listen)
                 {
                     // Signal result
+                    g_autoptr(GSocketAddress) sockaddr = dht_address_deserialize(addr);
                     g_socket_connect(connection->socket, sockaddr, NULL, NULL);
                     g_signal_emit(client, dht_client_signals[SIGNAL_NEW_CONNECTION], 0,
                             &connection->id, connection->socket, &connection->enc_key, &connection->dec_key);
@@ -941,14 +3279,30 @@ static gboolean dht_client_receive_cb(GSocket *socket, GIOCondition condition, g
             break;
         }
 
+        case MSG_CONNECTION_COOKIE:
+        {
+            if(len != sizeof(MsgCookie)) break;
+            MsgCookie *msg = (MsgCookie*)buffer;
+
+            // Find connection
+            DhtConnection *connection = g_hash_table_lookup(priv->connection_table, &msg->peer_nonce);
+            if(!connection || connection->is_remote) break;
+            g_debug("Connection cookie %08x", dht_id_hash(&connection->id));
+
+            // Repeat request with the cookie, allowing for the extra round trip
+            memcpy(connection->cookie, msg->cookie, DHT_COOKIE_SIZE);
+            connection->has_cookie = TRUE;
+            dht_connection_request(connection);
+            dht_timer_start(&connection->timer, DHT_TIMEOUT_MS);
+            break;
+        }
+
         default:
             g_debug("Unknown message code 0x%x", buffer[0]);
     }
-
-    return G_SOURCE_CONTINUE;
 }
 
-static gboolean dht_query_timeout_cb(gpointer arg)
+static void dht_query_timeout_cb(gpointer arg)
 {
     DhtQuery *query = arg;
     DhtLookup *lookup = query->lookup;
@@ -958,24 +3312,64 @@ static gboolean dht_query_timeout_cb(gpointer arg)
     dht_id_xor(&id, &query->metric, &lookup->id);
 
     // Update node
-    dht_client_update(client, &id, &query->addr, FALSE);
+    dht_client_update(client, &id, &query->addr, FALSE, 0);
     query->is_finished = TRUE;
 
     // Update source counter
-    query->timeout_source = 0;
+    if(query->is_hedged) lookup->num_hedged--;
+    else lookup->num_sources--;
+
+    lookup->num_timeouts++;
+    dht_lookup_adapt(lookup, FALSE);
+
+    // Dispatch lookup
+    dht_lookup_dispatch(lookup);
+    dht_client_flush(client);
+}
+
+static void dht_query_hedge_cb(gpointer arg)
+{
+    DhtQuery *query = arg;
+    DhtLookup *lookup = query->lookup;
+    DhtClient *client = lookup->client;
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Keep waiting for late response
+    dht_timer_init(&query->timer, priv->timer_wheel, dht_query_timeout_cb, query);
+    dht_timer_start(&query->timer, query->timeout_remaining);
+    if(lookup->num_hedges >= DHT_HEDGE_COUNT)
+        return;
+
+    g_debug("Hedge query %08x", dht_address_hash(&query->addr));
+
+    // Release the slot for another request
+    query->is_hedged = TRUE;
     lookup->num_sources--;
+    lookup->num_hedged++;
+    lookup->num_hedges++;
 
     // Dispatch lookup
     dht_lookup_dispatch(lookup);
-    return G_SOURCE_REMOVE;
+    dht_client_flush(client);
 }
 
-static gboolean dht_connection_timeout_cb(gpointer arg)
+static void dht_connection_timeout_cb(gpointer arg)
 {
     DhtConnection *connection = arg;
     DhtClient *client = connection->client;
     DhtClientPrivate *priv = dht_client_get_instance_private(client);
 
+    // A loaded responder drops requests, resend a few times with backoff
+    if(!connection->is_remote && (connection->num_retries < DHT_CONNECTION_RETRIES))
+    {
+        connection->num_retries++;
+        g_debug("Resend connection request %08x", dht_id_hash(&connection->id));
+        dht_connection_request(connection);
+        dht_timer_start(&connection->timer, DHT_TIMEOUT_MS << connection->num_retries);
+        dht_client_flush(client);
+        return;
+    }
+
     if(connection->result)
     {
         g_simple_async_result_set_error(connection->result, G_IO_ERROR, G_IO_ERROR_TIMED_OUT, _("Operation timed out"));
@@ -983,38 +3377,32 @@ static gboolean dht_connection_timeout_cb(gpointer arg)
         g_clear_object(&connection->result);
     }
 
-    connection->timeout_source = 0;
-    g_hash_table_remove(priv->connection_table, &connection->nonce);
-    return G_SOURCE_REMOVE;
-}
-
-static void dht_node_destroy_cb(gpointer arg)
-{
-    g_slice_free(DhtNode, arg);
-}
+    // Stale address, resolve again next time
+    if(!connection->is_remote)
+        dht_client_forget_peer(client, &connection->id);
 
-static void dht_bucket_destroy_cb(gpointer arg)
-{
-    g_list_free_full(arg, dht_node_destroy_cb);
+    g_hash_table_remove(priv->connection_table, &connection->nonce);
 }
 
-static void dht_query_destroy_cb(gpointer arg)
+static void dht_lookup_destroy_cb(gpointer arg)
 {
-    DhtQuery *query = arg;
+    DhtLookup *lookup = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(lookup->client);
 
-    if(query->timeout_source > 0)
-        g_source_remove(query->timeout_source);
+    g_debug("Lookup %08x finished (%u queries, %u timeouts, concurrency %u)",
+            dht_id_hash(&lookup->id), lookup->num_queries, lookup->num_timeouts, lookup->max_concurrency);
 
-    g_slice_free(DhtQuery, query);
-}
+    priv->stats.lookups++;
+    priv->stats.lookup_queries += lookup->num_queries;
+    priv->stats.lookup_timeouts += lookup->num_timeouts;
+    priv->stats.lookup_concurrency += lookup->max_concurrency;
 
-static void dht_lookup_destroy_cb(gpointer arg)
-{
-    DhtLookup *lookup = arg;
+    guint i;
+    for(i = 0; i < lookup->num_candidates; i++)
+        dht_timer_stop(&lookup->queries[i].timer);
 
-    g_sequence_free(lookup->query_sequence);
-    g_hash_table_destroy(lookup->query_table);
     g_slist_free_full(lookup->results, dht_result_destroy_cb);
+    g_slist_free(lookup->probes);
     g_slice_free(DhtLookup, lookup);
 }
 
@@ -1022,15 +3410,39 @@ static void dht_connection_destroy_cb(gpointer arg)
 {
     DhtConnection *connection = arg;
 
-    if(connection->timeout_source > 0)
-        g_source_remove(connection->timeout_source);
-
+    dht_timer_stop(&connection->timer);
     g_clear_object(&connection->socket);
     g_clear_object(&connection->sockaddr);
     g_clear_pointer(&connection->result, dht_result_destroy_cb);
     g_slice_free(DhtConnection, connection);
 }
 
+static void dht_worker_destroy_cb(gpointer arg)
+{
+    DhtWorker *worker = arg;
+
+    if(worker->thread)
+    {
+        // Quit from inside the loop, it may not be running yet
+        g_autoptr(GSource) source = g_idle_source_new();
+        g_source_set_callback(source, dht_worker_quit_cb, worker, NULL);
+        g_source_attach(source, worker->context);
+        g_thread_join(worker->thread);
+    }
+
+    g_main_loop_unref(worker->loop);
+    g_main_context_unref(worker->context);
+    g_object_unref(worker->socket);
+    g_free(worker->receiver);
+    g_free(worker->sources);
+    g_slice_free(DhtWorker, worker);
+}
+
+static void dht_peer_destroy_cb(gpointer arg)
+{
+    g_slice_free(DhtPeer, arg);
+}
+
 static void dht_result_destroy_cb(gpointer arg)
 {
     GSimpleAsyncResult *result = arg;
@@ -20,6 +20,14 @@
 #define DHT_TYPE_CLIENT dht_client_get_type()
 G_DECLARE_DERIVABLE_TYPE(DhtClient, dht_client, DHT, CLIENT, GObject)
 
+typedef struct _DhtClientStats DhtClientStats;
+
+// Unsigned tuning properties, NULL terminated
+extern const gchar *const dht_client_tunables[];
+
+// Address is NULL if the target was not found
+typedef void (*DhtProbeCallback)(DhtClient *client, const DhtId *id, GSocketAddress *address, gpointer user_data);
+
 struct _DhtClientClass
 {
     GObjectClass parent_class;
@@ -27,14 +35,56 @@ struct _DhtClientClass
     void (*new_connection)(DhtClient *client, DhtId *id, GSocket *socket, DhtKey *enc_key, DhtKey *dec_key);
 };
 
+struct _DhtClientStats
+{
+    guint64 lookups; // finished lookups
+    guint64 lookup_queries; // requests sent by finished lookups
+    guint64 lookup_timeouts; // requests timed out in finished lookups
+    guint64 lookup_concurrency; // sum of the highest concurrency used by each finished lookup
+    guint64 peer_hits; // lookups connecting directly to a recently resolved address
+    guint64 receive_wakeups; // socket dispatches
+    guint64 receive_messages; // datagrams handled over all dispatches
+    guint receive_batch_max; // most datagrams handled in one dispatch
+    guint64 worker_requests; // lookup requests answered by worker threads
+    guint64 inbox_dropped; // packets dropped by workers while the main thread queue was full
+    guint64 requests_dropped; // lookup and connection requests over the per-source rate
+    guint64 handshakes_dropped; // connection requests over the global key exchange budget or queue limit
+    guint64 handshakes_offloaded; // key exchanges computed by the crypto thread pool
+    guint64 cookies_sent; // connection requests answered with a cookie
+    guint64 cookies_rejected; // connection requests with an invalid or expired cookie
+    guint64 key_cache_hits; // handshakes reusing a cached shared secret
+    guint64 key_cache_misses; // handshakes computing a shared secret
+    guint64 key_cache_saved_us; // estimated key exchange time saved by the cache
+    guint64 probe_targets; // distinct IDs resolved by probes
+    guint64 probe_shared; // lookup responses shared with sibling probe lookups
+    gint64 fill_time_us; // time from the first successful self-lookup to a full table, zero until filled
+    guint64 fill_requests; // requests spent filling the table
+    guint64 bucket_refreshes; // lookups refreshing idle buckets
+};
+
 DhtClient* dht_client_new(DhtKey *key);
 
 gboolean dht_client_bind(DhtClient *client, GSocketAddress *address, gboolean allow_reuse, GError **error);
 
+gboolean dht_client_start_workers(DhtClient *client, guint count, GError **error);
+
 void dht_client_bootstrap(DhtClient *client, GSocketAddress *address);
 
+gboolean dht_client_load_nodes(DhtClient *client, const gchar *path, GError **error);
+
+gboolean dht_client_save_nodes(DhtClient *client, const gchar *path, GError **error);
+
 void dht_client_lookup_async(DhtClient *client, const DhtId *id, GAsyncReadyCallback callback, gpointer user_data);
 
 gboolean dht_client_lookup_finish(DhtClient *client, GAsyncResult *result, GSocket **socket, DhtKey *enc_key, DhtKey *dec_key, GError **error);
 
+void dht_client_probe_many_async(DhtClient *client, const DhtId *ids, guint count, DhtProbeCallback progress, gpointer progress_data,
+        GAsyncReadyCallback callback, gpointer user_data);
+
+gboolean dht_client_probe_many_finish(DhtClient *client, GAsyncResult *result, guint *num_found, GError **error);
+
+gboolean dht_client_get_rtt(DhtClient *client, const DhtId *id, gint64 *srtt, gint64 *rttvar);
+
+void dht_client_get_stats(DhtClient *client, DhtClientStats *stats);
+
 #endif /* __DHT_CLIENT_H__ */
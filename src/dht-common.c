@@ -13,9 +13,33 @@
  */
 
 #include <string.h>
+#include <netinet/in.h>
 #include <sodium.h>
 #include "dht-common.h"
 
+#define DHT_KEY_CACHE_COUNT 64 // number of cached peer keys
+
+typedef struct _DhtKeyEntry DhtKeyEntry;
+
+struct _DhtKeyEntry
+{
+    DhtKey pubkey;
+    DhtKey shared; // valid if has_shared
+    DhtId id;
+    gboolean has_shared;
+    guint64 stamp; // last use
+};
+
+struct _DhtKeyCache
+{
+    DhtKeyEntry entries[DHT_KEY_CACHE_COUNT];
+    guint num_entries;
+    guint64 clock;
+
+    guint64 hits, misses;
+    gint64 miss_time; // microseconds spent computing shared secrets
+};
+
 G_DEFINE_BOXED_TYPE(DhtKey, dht_key, dht_key_copy, dht_key_free)
 G_DEFINE_BOXED_TYPE(DhtId, dht_id, dht_id_copy, dht_id_free)
 G_DEFINE_BOXED_TYPE(DhtAddress, dht_address, dht_address_copy, dht_address_free)
@@ -76,6 +100,123 @@ void dht_key_derive(DhtKey *key, DhtKey *tag, const DhtKey *shared, const DhtKey
     *tag = result[1];
 }
 
+void dht_key_wipe(DhtKey *key)
+{
+    sodium_memzero(key->data, DHT_KEY_SIZE);
+}
+
+void dht_cookie_make(gpointer cookie, const DhtKey *secret, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *nonce)
+{
+    crypto_generichash_state state;
+
+    crypto_generichash_blake2b_init(&state, secret->data, DHT_KEY_SIZE, DHT_COOKIE_SIZE);
+    crypto_generichash_blake2b_update(&state, addr->data, DHT_ADDRESS_SIZE);
+    crypto_generichash_blake2b_update(&state, pubkey->data, DHT_KEY_SIZE);
+    crypto_generichash_blake2b_update(&state, nonce->data, DHT_KEY_SIZE);
+    crypto_generichash_blake2b_final(&state, cookie, DHT_COOKIE_SIZE);
+}
+
+gboolean dht_cookie_verify(gconstpointer cookie, const DhtKey *secret, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *nonce)
+{
+    guint8 computed_cookie[DHT_COOKIE_SIZE];
+    dht_cookie_make(computed_cookie, secret, addr, pubkey, nonce);
+
+    return sodium_memcmp(cookie, computed_cookie, DHT_COOKIE_SIZE) == 0;
+}
+
+DhtKeyCache* dht_key_cache_new(void)
+{
+    DhtKeyCache *cache = sodium_malloc(sizeof(DhtKeyCache));
+    g_assert(cache != NULL);
+
+    memset(cache, 0, sizeof(DhtKeyCache));
+    return cache;
+}
+
+void dht_key_cache_free(DhtKeyCache *cache)
+{
+    // Wiped by sodium_free
+    sodium_free(cache);
+}
+
+static DhtKeyEntry* dht_key_cache_find(DhtKeyCache *cache, const DhtKey *pubkey, gboolean create)
+{
+    DhtKeyEntry *entry, *oldest = cache->entries;
+    for(entry = cache->entries; entry < cache->entries + cache->num_entries; entry++)
+    {
+        if(memcmp(entry->pubkey.data, pubkey->data, DHT_KEY_SIZE) == 0)
+        {
+            entry->stamp = ++cache->clock;
+            return entry;
+        }
+
+        if(entry->stamp < oldest->stamp)
+            oldest = entry;
+    }
+
+    // Unauthenticated lookups must not evict anything
+    if(!create)
+        return NULL;
+
+    // Evict least recently used entry
+    if(cache->num_entries < DHT_KEY_CACHE_COUNT) entry = &cache->entries[cache->num_entries++];
+    else entry = oldest;
+
+    sodium_memzero(entry, sizeof(DhtKeyEntry));
+    entry->pubkey = *pubkey;
+    entry->stamp = ++cache->clock;
+    dht_id_from_pubkey(&entry->id, pubkey);
+    return entry;
+}
+
+void dht_key_cache_get_id(DhtKeyCache *cache, DhtId *id, const DhtKey *pubkey)
+{
+    DhtKeyEntry *entry = dht_key_cache_find(cache, pubkey, FALSE);
+    if(entry) *id = entry->id;
+    else dht_id_from_pubkey(id, pubkey);
+}
+
+gboolean dht_key_cache_get_shared(DhtKeyCache *cache, DhtKey *shared, const DhtKey *privkey, const DhtKey *pubkey)
+{
+    if(dht_key_cache_find_shared(cache, shared, pubkey))
+        return TRUE;
+
+    gint64 timestamp = g_get_monotonic_time();
+    if(!dht_key_make_shared(shared, privkey, pubkey))
+        return FALSE;
+
+    dht_key_cache_add_shared(cache, pubkey, shared, g_get_monotonic_time() - timestamp);
+    return TRUE;
+}
+
+gboolean dht_key_cache_find_shared(DhtKeyCache *cache, DhtKey *shared, const DhtKey *pubkey)
+{
+    DhtKeyEntry *entry = dht_key_cache_find(cache, pubkey, FALSE);
+    if(!entry || !entry->has_shared)
+        return FALSE;
+
+    cache->hits++;
+    *shared = entry->shared;
+    return TRUE;
+}
+
+void dht_key_cache_add_shared(DhtKeyCache *cache, const DhtKey *pubkey, const DhtKey *shared, gint64 elapsed)
+{
+    DhtKeyEntry *entry = dht_key_cache_find(cache, pubkey, TRUE);
+
+    cache->misses++;
+    cache->miss_time += elapsed;
+    entry->has_shared = TRUE;
+    entry->shared = *shared;
+}
+
+void dht_key_cache_get_stats(DhtKeyCache *cache, guint64 *hits, guint64 *misses, gint64 *miss_time)
+{
+    if(hits) *hits = cache->hits;
+    if(misses) *misses = cache->misses;
+    if(miss_time) *miss_time = cache->miss_time;
+}
+
 void dht_id_from_pubkey(DhtId *id, const DhtKey *pubkey)
 {
     crypto_generichash_blake2b(id->data, DHT_ID_SIZE, pubkey->data, DHT_KEY_SIZE, NULL, 0);
@@ -104,11 +245,67 @@ gchar* dht_id_to_string(const DhtId *id)
     return g_base64_encode(id->data, DHT_ID_SIZE);
 }
 
+static inline void dht_id_xor_words(guint8 *res, const guint8 *a, const guint8 *b)
+{
+    // XOR 64-bit words, the loops are unrolled for constant ID size
+    guint i;
+    for(i = 0; i + 8 <= DHT_ID_SIZE; i += 8)
+    {
+        guint64 wa, wb;
+        memcpy(&wa, a + i, 8);
+        memcpy(&wb, b + i, 8);
+        wa ^= wb;
+        memcpy(res + i, &wa, 8);
+    }
+
+    for(; i + 4 <= DHT_ID_SIZE; i += 4)
+    {
+        guint32 wa, wb;
+        memcpy(&wa, a + i, 4);
+        memcpy(&wb, b + i, 4);
+        wa ^= wb;
+        memcpy(res + i, &wa, 4);
+    }
+
+    for(; i < DHT_ID_SIZE; i++)
+        res[i] = a[i] ^ b[i];
+}
+
 void dht_id_xor(DhtId *res, const DhtId *a, const DhtId *b)
 {
-    int i;
-    for(i = 0; i < DHT_ID_SIZE; i++)
-        res->data[i] = a->data[i] ^ b->data[i];
+    dht_id_xor_words(res->data, a->data, b->data);
+}
+
+void dht_id_xor_array(DhtId *res, gconstpointer ids, gsize stride, guint count, const DhtId *id)
+{
+    // Compute metrics of an array of structures starting with DhtId
+    const guint8 *ptr = ids;
+    while(count--)
+    {
+        dht_id_xor_words(res->data, ptr, id->data);
+        ptr += stride;
+        res++;
+    }
+}
+
+guint dht_id_prefix_len(const DhtId *metric)
+{
+    // Count leading zero bits, 64-bit words first
+    guint i;
+    for(i = 0; i + 8 <= DHT_ID_SIZE; i += 8)
+    {
+        guint64 word;
+        memcpy(&word, metric->data + i, 8);
+        if(word) return i * 8 + __builtin_clzll(GUINT64_FROM_BE(word));
+    }
+
+    for(; i < DHT_ID_SIZE; i++)
+    {
+        if(metric->data[i])
+            return i * 8 + __builtin_clz(metric->data[i]) - (sizeof(unsigned int) - 1) * 8;
+    }
+
+    return DHT_ID_SIZE * 8;
 }
 
 void dht_address_serialize(DhtAddress *addr, GSocketAddress *sockaddr)
@@ -129,6 +326,30 @@ GSocketAddress* dht_address_deserialize(const DhtAddress *addr)
     return g_inet_socket_address_new(inaddr, port);
 }
 
+gboolean dht_address_from_native(DhtAddress *addr, gconstpointer native, gsize len)
+{
+    const struct sockaddr_in *sin = native;
+    if((len < sizeof(struct sockaddr_in)) || (sin->sin_family != AF_INET))
+        return FALSE;
+
+    // Both are in network byte order
+    memcpy(addr->data, &sin->sin_port, 2);
+    memcpy(addr->data + 2, &sin->sin_addr, DHT_ADDRESS_SIZE - 2);
+    return TRUE;
+}
+
+gsize dht_address_to_native(const DhtAddress *addr, gpointer native, gsize len)
+{
+    struct sockaddr_in *sin = native;
+    g_return_val_if_fail(len >= sizeof(struct sockaddr_in), 0);
+
+    memset(sin, 0, sizeof(struct sockaddr_in));
+    sin->sin_family = AF_INET;
+    memcpy(&sin->sin_port, addr->data, 2);
+    memcpy(&sin->sin_addr, addr->data + 2, DHT_ADDRESS_SIZE - 2);
+    return sizeof(struct sockaddr_in);
+}
+
 gpointer dht_key_copy(gpointer key)
 {
     return g_slice_dup(DhtKey, key);
@@ -184,7 +405,24 @@ gboolean dht_address_equal(gconstpointer a, gconstpointer b)
 
 gint dht_id_compare(gconstpointer a, gconstpointer b, gpointer arg)
 {
-    return memcmp(a, b, DHT_ID_SIZE);
+    // Big-endian compare on 64-bit words
+    const guint8 *pa = a, *pb = b;
+    guint i;
+    for(i = 0; i + 8 <= DHT_ID_SIZE; i += 8)
+    {
+        guint64 wa, wb;
+        memcpy(&wa, pa + i, 8);
+        memcpy(&wb, pb + i, 8);
+        if(wa != wb) return GUINT64_FROM_BE(wa) < GUINT64_FROM_BE(wb) ? -1 : 1;
+    }
+
+    for(; i < DHT_ID_SIZE; i++)
+    {
+        if(pa[i] != pb[i])
+            return pa[i] < pb[i] ? -1 : 1;
+    }
+
+    return 0;
 }
 
 void dht_key_free(gpointer key)
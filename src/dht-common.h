@@ -20,6 +20,7 @@
 
 #define DHT_KEY_SIZE 32
 #define DHT_ID_SIZE 20
+#define DHT_COOKIE_SIZE 16
 
 #define DHT_ADDRESS_FAMILY G_SOCKET_FAMILY_IPV4
 #define DHT_ADDRESS_SIZE (2+4) // port + IP address
@@ -31,6 +32,7 @@
 typedef struct _DhtKey DhtKey;
 typedef struct _DhtId DhtId;
 typedef struct _DhtAddress DhtAddress;
+typedef struct _DhtKeyCache DhtKeyCache;
 
 struct _DhtKey
 {
@@ -56,14 +58,33 @@ void dht_key_make_random(DhtKey *key);
 void dht_key_make_public(DhtKey *pubkey, const DhtKey *privkey);
 gboolean dht_key_make_shared(DhtKey *shared, const DhtKey *privkey, const DhtKey *pubkey);
 void dht_key_derive(DhtKey *key, DhtKey *tag, const DhtKey *secret, const DhtKey *tx_nonce, const DhtKey *rx_nonce);
+void dht_key_wipe(DhtKey *key);
+
+// Keyed MAC binding a handshake request to its source address
+void dht_cookie_make(gpointer cookie, const DhtKey *secret, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *nonce);
+gboolean dht_cookie_verify(gconstpointer cookie, const DhtKey *secret, const DhtAddress *addr, const DhtKey *pubkey, const DhtKey *nonce);
+
+// Recently seen peer keys with their IDs and shared secrets, kept in guarded memory
+// Only storing a shared secret inserts an entry, lookups of unverified keys never evict
+DhtKeyCache* dht_key_cache_new(void);
+void dht_key_cache_free(DhtKeyCache *cache);
+void dht_key_cache_get_id(DhtKeyCache *cache, DhtId *id, const DhtKey *pubkey);
+gboolean dht_key_cache_get_shared(DhtKeyCache *cache, DhtKey *shared, const DhtKey *privkey, const DhtKey *pubkey);
+gboolean dht_key_cache_find_shared(DhtKeyCache *cache, DhtKey *shared, const DhtKey *pubkey);
+void dht_key_cache_add_shared(DhtKeyCache *cache, const DhtKey *pubkey, const DhtKey *shared, gint64 elapsed);
+void dht_key_cache_get_stats(DhtKeyCache *cache, guint64 *hits, guint64 *misses, gint64 *miss_time);
 
 void dht_id_from_pubkey(DhtId *id, const DhtKey *pubkey);
 gboolean dht_id_from_string(DhtId *id, const gchar *str);
 gchar* dht_id_to_string(const DhtId *id);
 void dht_id_xor(DhtId *res, const DhtId *a, const DhtId *b);
+void dht_id_xor_array(DhtId *res, gconstpointer ids, gsize stride, guint count, const DhtId *id);
+guint dht_id_prefix_len(const DhtId *metric);
 
 void dht_address_serialize(DhtAddress *addr, GSocketAddress *sockaddr);
 GSocketAddress* dht_address_deserialize(const DhtAddress *addr);
+gboolean dht_address_from_native(DhtAddress *addr, gconstpointer native, gsize len); // struct sockaddr_in
+gsize dht_address_to_native(const DhtAddress *addr, gpointer native, gsize len);
 
 gpointer dht_key_copy(gpointer key);
 gpointer dht_id_copy(gpointer id);
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2016 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <string.h>
+#include "dht-timer.h"
+
+#define DHT_TIMER_LEVELS 4 // number of wheel levels
+#define DHT_TIMER_BITS 6 // log2 of slots per level
+#define DHT_TIMER_SLOTS (1 << DHT_TIMER_BITS)
+#define DHT_TIMER_MASK (DHT_TIMER_SLOTS - 1)
+#define DHT_TIMER_RANGE (G_GUINT64_CONSTANT(1) << (DHT_TIMER_LEVELS * DHT_TIMER_BITS)) // ticks covered by the wheel (~4.6 hours)
+#define DHT_TIMER_NEVER G_MAXUINT64
+
+struct _DhtTimerWheel
+{
+    GSource source;
+
+    gint64 epoch; // monotonic time of tick zero
+    guint64 now; // last processed tick
+    guint64 next; // tick the source is scheduled for
+
+    guint64 occupied[DHT_TIMER_LEVELS]; // non-empty slots
+    DhtTimer *slots[DHT_TIMER_LEVELS][DHT_TIMER_SLOTS];
+    DhtTimer *expired; // timers being dispatched
+};
+
+static gboolean dht_timer_wheel_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+static GSourceFuncs dht_timer_wheel_funcs =
+{
+    NULL, NULL, dht_timer_wheel_dispatch, NULL
+};
+
+static void dht_timer_link(DhtTimer *timer, DhtTimer **head)
+{
+    timer->prev = NULL;
+    timer->next = *head;
+    if(*head) (*head)->prev = timer;
+    *head = timer;
+}
+
+static void dht_timer_unlink(DhtTimerWheel *wheel, DhtTimer *timer)
+{
+    DhtTimer **head = (timer->level < DHT_TIMER_LEVELS) ? &wheel->slots[timer->level][timer->slot] : &wheel->expired;
+
+    if(timer->prev) timer->prev->next = timer->next;
+    else *head = timer->next;
+    if(timer->next) timer->next->prev = timer->prev;
+
+    if(!*head && (timer->level < DHT_TIMER_LEVELS))
+        wheel->occupied[timer->level] &= ~(G_GUINT64_CONSTANT(1) << timer->slot);
+}
+
+static void dht_timer_insert(DhtTimerWheel *wheel, DhtTimer *timer)
+{
+    // Place far timers at the top level, they are re-inserted on cascade
+    guint64 expires = MIN(timer->expires, wheel->now + DHT_TIMER_RANGE - 1);
+    guint64 delta = expires - wheel->now;
+
+    // Pick the lowest level whose span covers the delta
+    guint level = 0;
+    while((level < DHT_TIMER_LEVELS - 1) && (delta >> ((level + 1) * DHT_TIMER_BITS)))
+        level++;
+
+    timer->level = level;
+    timer->slot = (expires >> (level * DHT_TIMER_BITS)) & DHT_TIMER_MASK;
+    wheel->occupied[level] |= G_GUINT64_CONSTANT(1) << timer->slot;
+    dht_timer_link(timer, &wheel->slots[level][timer->slot]);
+}
+
+static guint64 dht_timer_wheel_next(DhtTimerWheel *wheel)
+{
+    guint level;
+    guint64 next = DHT_TIMER_NEVER;
+
+    // Nearest occupied slot after the current one at each level
+    for(level = 0; level < DHT_TIMER_LEVELS; level++)
+    {
+        guint64 bits = wheel->occupied[level];
+        if(!bits) continue;
+
+        guint shift = level * DHT_TIMER_BITS;
+        guint64 block = (wheel->now >> shift) + 1;
+        guint rot = block & DHT_TIMER_MASK;
+        if(rot) bits = (bits >> rot) | (bits << (DHT_TIMER_SLOTS - rot));
+
+        next = MIN(next, (block + __builtin_ctzll(bits)) << shift);
+    }
+
+    return next;
+}
+
+static void dht_timer_wheel_schedule(DhtTimerWheel *wheel, guint64 next)
+{
+    wheel->next = next;
+    g_source_set_ready_time(&wheel->source, (next == DHT_TIMER_NEVER) ? -1 : wheel->epoch + (gint64)next * 1000);
+}
+
+static void dht_timer_wheel_cascade(DhtTimerWheel *wheel, guint level, guint slot)
+{
+    DhtTimer *list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(G_GUINT64_CONSTANT(1) << slot);
+
+    while(list)
+    {
+        DhtTimer *timer = list;
+        list = list->next;
+        dht_timer_insert(wheel, timer);
+    }
+}
+
+static void dht_timer_wheel_expire(DhtTimerWheel *wheel, guint slot)
+{
+    DhtTimer *timer;
+    for(timer = wheel->slots[0][slot]; timer; timer = timer->next)
+        timer->level = DHT_TIMER_LEVELS;
+
+    wheel->expired = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    wheel->occupied[0] &= ~(G_GUINT64_CONSTANT(1) << slot);
+
+    // Callbacks may stop or restart any timer, including the expired ones
+    while(wheel->expired)
+    {
+        timer = wheel->expired;
+        dht_timer_unlink(wheel, timer);
+        timer->is_active = FALSE;
+        timer->func(timer->user_data);
+    }
+}
+
+static void dht_timer_wheel_advance(DhtTimerWheel *wheel, guint64 target)
+{
+    while(wheel->now < target)
+    {
+        // Skip ticks without any expiry or cascade
+        guint64 tick = dht_timer_wheel_next(wheel);
+        if(tick > target)
+        {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now = tick;
+
+        // Move timers down from higher levels starting a new block
+        guint level;
+        for(level = DHT_TIMER_LEVELS - 1; level > 0; level--)
+        {
+            guint shift = level * DHT_TIMER_BITS;
+            if(!(tick & ((G_GUINT64_CONSTANT(1) << shift) - 1)))
+                dht_timer_wheel_cascade(wheel, level, (tick >> shift) & DHT_TIMER_MASK);
+        }
+
+        dht_timer_wheel_expire(wheel, tick & DHT_TIMER_MASK);
+    }
+}
+
+static gboolean dht_timer_wheel_dispatch(GSource *source, G_GNUC_UNUSED GSourceFunc callback, G_GNUC_UNUSED gpointer user_data)
+{
+    DhtTimerWheel *wheel = (DhtTimerWheel*)source;
+
+    dht_timer_wheel_advance(wheel, (g_source_get_time(source) - wheel->epoch) / 1000);
+    dht_timer_wheel_schedule(wheel, dht_timer_wheel_next(wheel));
+    return G_SOURCE_CONTINUE;
+}
+
+DhtTimerWheel* dht_timer_wheel_new(void)
+{
+    DhtTimerWheel *wheel = (DhtTimerWheel*)g_source_new(&dht_timer_wheel_funcs, sizeof(DhtTimerWheel));
+    wheel->epoch = g_get_monotonic_time();
+    wheel->now = 0;
+    wheel->next = DHT_TIMER_NEVER;
+    wheel->expired = NULL;
+    memset(wheel->occupied, 0, sizeof(wheel->occupied));
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+
+    g_source_attach(&wheel->source, g_main_context_default());
+    return wheel;
+}
+
+void dht_timer_wheel_free(DhtTimerWheel *wheel)
+{
+    g_source_destroy(&wheel->source);
+    g_source_unref(&wheel->source);
+}
+
+void dht_timer_init(DhtTimer *timer, DhtTimerWheel *wheel, DhtTimerFunc func, gpointer user_data)
+{
+    timer->next = timer->prev = NULL;
+    timer->is_active = FALSE;
+    timer->wheel = wheel;
+    timer->func = func;
+    timer->user_data = user_data;
+}
+
+void dht_timer_start(DhtTimer *timer, guint timeout_ms)
+{
+    DhtTimerWheel *wheel = timer->wheel;
+    if(timer->is_active) dht_timer_unlink(wheel, timer);
+
+    // Round up so that timers never fire early
+    guint64 now = (g_get_monotonic_time() - wheel->epoch + 999) / 1000;
+    timer->expires = MAX(now + timeout_ms, wheel->now + 1);
+    timer->is_active = TRUE;
+    dht_timer_insert(wheel, timer);
+
+    if(timer->expires < wheel->next)
+        dht_timer_wheel_schedule(wheel, timer->expires);
+}
+
+void dht_timer_stop(DhtTimer *timer)
+{
+    if(!timer->is_active) return;
+
+    dht_timer_unlink(timer->wheel, timer);
+    timer->is_active = FALSE;
+}
+
+gboolean dht_timer_is_active(const DhtTimer *timer)
+{
+    return timer->is_active;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2016 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __DHT_TIMER_H__
+#define __DHT_TIMER_H__
+
+#include <glib.h>
+
+typedef struct _DhtTimer DhtTimer;
+typedef struct _DhtTimerWheel DhtTimerWheel;
+
+typedef void (*DhtTimerFunc)(gpointer user_data);
+
+// Embedded in the owner, must be stopped before it is freed
+struct _DhtTimer
+{
+    DhtTimer *next, *prev;
+    guint64 expires;
+    guint level, slot;
+    gboolean is_active;
+
+    DhtTimerFunc func;
+    gpointer user_data;
+    DhtTimerWheel *wheel; // weak
+};
+
+// Hierarchical wheel with millisecond ticks, driven by a single source in the default main context
+DhtTimerWheel* dht_timer_wheel_new(void);
+void dht_timer_wheel_free(DhtTimerWheel *wheel);
+
+void dht_timer_init(DhtTimer *timer, DhtTimerWheel *wheel, DhtTimerFunc func, gpointer user_data);
+void dht_timer_start(DhtTimer *timer, guint timeout_ms);
+void dht_timer_stop(DhtTimer *timer);
+gboolean dht_timer_is_active(const DhtTimer *timer);
+
+#endif /* __DHT_TIMER_H__ */
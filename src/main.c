@@ -17,7 +17,9 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <locale.h>
+#include <signal.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
 #include "dht-client.h"
 
 #ifdef ENABLE_GUI
@@ -25,6 +27,10 @@
 #endif /* ENABLE_GUI */
 
 #define DEFAULT_PORT 5004
+#define SUPERNODE_NODE_COUNT 32
+#define SUPERNODE_REPLACEMENT_COUNT 32
+#define SUPERNODE_SYMBOL_BITS 4
+#define SUPERNODE_SOCKET_BUFFER (4 << 20) // 4 MiB
 
 static DhtClient* startup(GKeyFile *config)
 {
@@ -32,6 +38,7 @@ static DhtClient* startup(GKeyFile *config)
     g_autofree gchar *base_path = g_build_filename(g_get_home_dir(), ".nanotalk", NULL);
     g_autofree gchar *config_path = g_build_filename(base_path, "user.cfg", NULL);
     g_autofree gchar *key_path = g_build_filename(base_path, "user.key", NULL);
+    g_autofree gchar *cache_path = g_build_filename(base_path, "nodes.cache", NULL);
     g_mkdir_with_parents(base_path, 0775);
 
     // Load configuration
@@ -56,10 +63,52 @@ static DhtClient* startup(GKeyFile *config)
 
     // Bind client
     DhtClient *client = dht_client_new((DhtKey*)key_data);
+
+    // Profile sets defaults, individual keys override them
+    g_autofree gchar *profile = g_key_file_get_string(config, "dht", "profile", NULL);
+    if(g_strcmp0(profile, "supernode") == 0)
+    {
+        // Always-on node with spare memory and bandwidth serving many lookups
+        g_object_set(client, "node-count", SUPERNODE_NODE_COUNT, "replacement-count", SUPERNODE_REPLACEMENT_COUNT,
+                "symbol-bits", SUPERNODE_SYMBOL_BITS, "socket-buffer", SUPERNODE_SOCKET_BUFFER, NULL);
+    }
+
+    // Tunables are read from the [dht] section under the property names
+    const gchar *const *name;
+    for(name = dht_client_tunables; *name; name++)
+    {
+        if(!g_key_file_has_key(config, "dht", *name, NULL))
+            continue;
+
+        // Out of range values are reported and skipped rather than wrapped
+        GParamSpecUInt *pspec = G_PARAM_SPEC_UINT(g_object_class_find_property(G_OBJECT_GET_CLASS(client), *name));
+        gint64 value = g_key_file_get_int64(config, "dht", *name, &error);
+        if(error)
+        {
+            g_printerr("%s\n", error->message);
+            g_clear_error(&error);
+        }
+        else if((value < pspec->minimum) || (value > pspec->maximum))
+        {
+            g_printerr("Ignoring %s = %" G_GINT64_FORMAT ", expected %u to %u\n", *name, value, pspec->minimum, pspec->maximum);
+        }
+        else g_object_set(client, *name, (guint)value, NULL);
+    }
+
+    if(g_key_file_has_key(config, "dht", "cookies", NULL))
+        g_object_set(client, "cookies", g_key_file_get_boolean(config, "dht", "cookies", NULL), NULL);
+
     guint16 local_port = g_key_file_get_integer(config, "network", "local-port", NULL);
     g_autoptr(GInetAddress) inaddr_any = g_inet_address_new_any(DHT_ADDRESS_FAMILY);
     g_autoptr(GSocketAddress) local_address = g_inet_socket_address_new(inaddr_any, local_port);
+#ifdef ENABLE_GUI
     dht_client_bind(client, local_address, FALSE, &error);
+#else
+    // Worker threads share the port, so the main socket must allow reuse as well
+    gint workers = g_key_file_get_integer(config, "dht", "workers", NULL);
+    if(dht_client_bind(client, local_address, workers > 0, &error) && (workers > 0))
+        dht_client_start_workers(client, workers, &error);
+#endif /* ENABLE_GUI */
     if(error)
     {
         g_printerr("%s\n", error->message);
@@ -87,9 +136,21 @@ static DhtClient* startup(GKeyFile *config)
         }
     }
 
+    // Restore nodes from previous run
+    g_object_set(client, "cache-file", cache_path, NULL);
+    dht_client_load_nodes(client, cache_path, NULL);
+
     return client;
 }
 
+#ifndef ENABLE_GUI
+static gboolean shutdown_cb(gpointer arg)
+{
+    g_main_loop_quit(arg);
+    return G_SOURCE_REMOVE;
+}
+#endif /* ENABLE_GUI */
+
 int main(int argc, char *argv[])
 {
     setlocale(LC_ALL, "");
@@ -111,9 +172,15 @@ int main(int argc, char *argv[])
 #ifdef ENABLE_GUI
     application_run(client, config);
 #else
-    (void)client;
     g_key_file_unref(config);
-    g_main_loop_run(g_main_loop_new(NULL, FALSE));
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGINT, shutdown_cb, loop);
+    g_unix_signal_add(SIGTERM, shutdown_cb, loop);
+    g_main_loop_run(loop);
+
+    // Saves node cache
+    g_main_loop_unref(loop);
+    g_object_unref(client);
 #endif /* ENABLE_GUI */
 
     return 0;
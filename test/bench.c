@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2016 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define G_LOG_DOMAIN "DHT"
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <glib/gi18n.h>
+#include "dht-client.h"
+#include "dht-timer.h"
+
+static guint64 bench_allocs; // GLib allocator calls made by the client
+
+// Count allocations in the client code below, GLib internals are not included
+#define g_malloc(n) (bench_allocs++, g_malloc(n))
+#define g_malloc0(n) (bench_allocs++, g_malloc0(n))
+#define g_malloc_n(n, s) (bench_allocs++, g_malloc_n(n, s))
+#define g_malloc0_n(n, s) (bench_allocs++, g_malloc0_n(n, s))
+#define g_realloc(p, n) (bench_allocs++, g_realloc(p, n))
+#define g_realloc_n(p, n, s) (bench_allocs++, g_realloc_n(p, n, s))
+#define g_slice_alloc(n) (bench_allocs++, g_slice_alloc(n))
+#define g_slice_alloc0(n) (bench_allocs++, g_slice_alloc0(n))
+#define g_slice_copy(n, p) (bench_allocs++, g_slice_copy(n, p))
+
+// Kernels under test are static, so the client is compiled into the benchmark
+#include "dht-client.c"
+
+#define BENCH_NODES 4096 // random nodes offered to the routing table
+#define BENCH_TARGETS 1024 // distinct search targets
+#define BENCH_ROUNDS 200000 // operations per measurement
+#define BENCH_HANDSHAKES 2000 // key exchanges per measurement
+#define BENCH_PEERS 32 // distinct peers, all fit the key cache
+#define BENCH_BURSTS 50 // handshake bursts per latency measurement
+
+typedef struct _BenchClock BenchClock;
+typedef struct _BenchQuery BenchQuery;
+typedef struct _BenchBurst BenchBurst;
+
+struct _BenchClock
+{
+    gint64 start, elapsed;
+    guint64 start_allocs, allocs;
+};
+
+struct _BenchQuery
+{
+    DhtId metric;
+    DhtAddress addr;
+};
+
+struct _BenchBurst
+{
+    DhtClient *client;
+    DhtKey peers[BENCH_PEERS];
+    gboolean is_offloaded;
+    gint64 posted, latency; // probe timestamps, latency is -1 until the probe runs
+};
+
+static volatile guint bench_sink; // keeps results alive
+
+static void bench_resume(BenchClock *clock)
+{
+    clock->start_allocs = bench_allocs;
+    clock->start = g_get_monotonic_time();
+}
+
+static void bench_pause(BenchClock *clock)
+{
+    clock->elapsed += g_get_monotonic_time() - clock->start;
+    clock->allocs += bench_allocs - clock->start_allocs;
+}
+
+static void bench_report(const gchar *name, const BenchClock *clock, guint64 count)
+{
+    g_print("%-24s %10.1f ns/op %8.3f allocs/op\n", name, clock->elapsed * 1000.0 / count, (gdouble)clock->allocs / count);
+}
+
+static void bench_random(GRand *rand, gpointer data, gsize len)
+{
+    guint8 *ptr = data;
+    while(len--) *ptr++ = g_rand_int(rand);
+}
+
+static void bench_xor(GRand *rand)
+{
+    MsgNode nodes[DHT_NODE_COUNT_MAX];
+    DhtId metrics[DHT_NODE_COUNT_MAX], target;
+    bench_random(rand, nodes, sizeof(nodes));
+    bench_random(rand, &target, sizeof(target));
+
+    guint i, j;
+    BenchClock single = {0}, array = {0};
+    bench_resume(&single);
+    for(i = 0; i < BENCH_ROUNDS; i++)
+    {
+        for(j = 0; j < DHT_NODE_COUNT_MAX; j++)
+            dht_id_xor(&metrics[j], &nodes[j].id, &target);
+    }
+
+    bench_pause(&single);
+    bench_report("xor", &single, (guint64)BENCH_ROUNDS * DHT_NODE_COUNT_MAX);
+
+    bench_resume(&array);
+    for(i = 0; i < BENCH_ROUNDS; i++)
+        dht_id_xor_array(metrics, nodes, sizeof(MsgNode), DHT_NODE_COUNT_MAX, &target);
+
+    bench_pause(&array);
+    bench_report("xor-array", &array, (guint64)BENCH_ROUNDS * DHT_NODE_COUNT_MAX);
+    bench_sink += metrics[0].data[0];
+}
+
+static void bench_table(GRand *rand, guint symbol_bits, guint node_count)
+{
+    DhtKey key;
+    dht_key_make_random(&key);
+    DhtClient *client = dht_client_new(&key);
+    g_object_set(client, "symbol-bits", symbol_bits, "node-count", node_count, NULL);
+
+    DhtId *ids = g_new(DhtId, BENCH_NODES);
+    DhtAddress *addrs = g_new(DhtAddress, BENCH_NODES);
+    DhtId *targets = g_new(DhtId, BENCH_TARGETS);
+    bench_random(rand, ids, BENCH_NODES * sizeof(DhtId));
+    bench_random(rand, addrs, BENCH_NODES * sizeof(DhtAddress));
+    bench_random(rand, targets, BENCH_TARGETS * sizeof(DhtId));
+
+    // Updates include bucket splits and replacement bookkeeping
+    guint i;
+    BenchClock update = {0}, search = {0};
+    bench_resume(&update);
+    for(i = 0; i < BENCH_NODES; i++)
+        dht_client_update(client, &ids[i], &addrs[i], TRUE, 1000 + i);
+
+    bench_pause(&update);
+
+    MsgNode nodes[DHT_NODE_COUNT_MAX];
+    bench_resume(&search);
+    for(i = 0; i < BENCH_ROUNDS; i++)
+        bench_sink += dht_client_search(client, &targets[i % BENCH_TARGETS], nodes);
+
+    bench_pause(&search);
+
+    gchar name[32];
+    g_snprintf(name, sizeof(name), "update b=%u k=%u", symbol_bits, node_count);
+    bench_report(name, &update, BENCH_NODES);
+    g_snprintf(name, sizeof(name), "search b=%u k=%u", symbol_bits, node_count);
+    bench_report(name, &search, BENCH_ROUNDS);
+
+    g_free(targets);
+    g_free(addrs);
+    g_free(ids);
+    g_object_unref(client);
+}
+
+static void bench_request(GRand *rand)
+{
+    DhtKey key;
+    dht_key_make_random(&key);
+    DhtClient *client = dht_client_new(&key);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Responses carry a full set of k nodes
+    guint i, j;
+    for(i = 0; i < BENCH_NODES; i++)
+    {
+        DhtId id;
+        DhtAddress addr;
+        bench_random(rand, &id, sizeof(id));
+        bench_random(rand, &addr, sizeof(addr));
+        dht_client_update(client, &id, &addr, TRUE, 0);
+    }
+
+    // Requests travel over loopback through the real receive and send path
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GInetAddress) loopback = g_inet_address_new_loopback(DHT_ADDRESS_FAMILY);
+    g_autoptr(GSocketAddress) address = g_inet_socket_address_new(loopback, 0);
+    g_autoptr(GSocket) requester = g_socket_new(DHT_ADDRESS_FAMILY, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
+    g_autoptr(GSocketAddress) local_address = NULL;
+    if(requester && dht_client_bind(client, address, FALSE, &error) && g_socket_bind(requester, address, FALSE, &error))
+        local_address = g_socket_get_local_address(priv->socket, &error);
+
+    if(!local_address)
+    {
+        g_printerr("%s\n", error->message);
+        g_object_unref(client);
+        return;
+    }
+
+    g_socket_set_blocking(requester, FALSE);
+
+    MsgLookup request;
+    request.type = MSG_LOOKUP_REQ;
+    bench_random(rand, &request.srcid, sizeof(request.srcid));
+
+    guint8 buffer[MSG_MTU];
+    guint64 handled = priv->stats.receive_messages;
+    BenchClock receive = {0};
+    for(i = 0; i < BENCH_ROUNDS / MSG_BATCH_COUNT; i++)
+    {
+        // A single requester would soon be rate limited
+        memset(priv->sources, 0, sizeof(DhtSource) << DHT_SOURCE_BITS);
+        for(j = 0; j < MSG_BATCH_COUNT; j++)
+        {
+            bench_random(rand, &request.dstid, sizeof(request.dstid));
+            g_socket_send_to(requester, local_address, (const gchar*)&request, sizeof(request), NULL, NULL);
+        }
+
+        bench_resume(&receive);
+        dht_client_receive_cb(priv->socket, G_IO_IN, client);
+        bench_pause(&receive);
+
+        while(g_socket_receive(requester, (gchar*)buffer, sizeof(buffer), NULL, NULL) > 0);
+    }
+
+    bench_report("lookup request", &receive, MAX(priv->stats.receive_messages - handled, 1));
+    g_object_unref(client);
+}
+
+static void bench_keys(void)
+{
+    DhtKey privkey, peers[BENCH_PEERS];
+    dht_key_make_random(&privkey);
+
+    guint i;
+    for(i = 0; i < BENCH_PEERS; i++)
+    {
+        DhtKey peer;
+        dht_key_make_random(&peer);
+        dht_key_make_public(&peers[i], &peer);
+    }
+
+    // Handshake key work per incoming connection: peer ID, then the shared secret
+    DhtId id;
+    DhtKey shared;
+    BenchClock compute = {0}, cached = {0};
+    bench_resume(&compute);
+    for(i = 0; i < BENCH_HANDSHAKES; i++)
+    {
+        dht_id_from_pubkey(&id, &peers[i % BENCH_PEERS]);
+        bench_sink += dht_key_make_shared(&shared, &privkey, &peers[i % BENCH_PEERS]);
+    }
+
+    bench_pause(&compute);
+
+    // Repeat peers hit the warm cache
+    DhtKeyCache *cache = dht_key_cache_new();
+    for(i = 0; i < BENCH_PEERS; i++)
+        dht_key_cache_get_shared(cache, &shared, &privkey, &peers[i]);
+
+    bench_resume(&cached);
+    for(i = 0; i < BENCH_HANDSHAKES; i++)
+    {
+        dht_key_cache_get_id(cache, &id, &peers[i % BENCH_PEERS]);
+        bench_sink += dht_key_cache_get_shared(cache, &shared, &privkey, &peers[i % BENCH_PEERS]);
+    }
+
+    bench_pause(&cached);
+    bench_report("handshake keys", &compute, BENCH_HANDSHAKES);
+    bench_report("handshake keys cached", &cached, BENCH_HANDSHAKES);
+
+    dht_key_cache_free(cache);
+    dht_key_wipe(&shared);
+    dht_key_wipe(&privkey);
+}
+
+static gboolean bench_burst_cb(gpointer arg)
+{
+    BenchBurst *burst = arg;
+    DhtClientPrivate *priv = dht_client_get_instance_private(burst->client);
+
+    // A burst of connection requests, key exchanges either run here or go to the crypto pool
+    guint i;
+    for(i = 0; i < BENCH_PEERS; i++)
+    {
+        DhtId id;
+        DhtAddress addr = {{0}};
+        DhtKey nonce = {{0}};
+        dht_id_from_pubkey(&id, &burst->peers[i]);
+        if(burst->is_offloaded)
+        {
+            dht_client_offload(burst->client, &id, &addr, &burst->peers[i], &nonce);
+            continue;
+        }
+
+        DhtKey shared;
+        bench_sink += dht_key_make_shared(&shared, &priv->privkey, &burst->peers[i]);
+        dht_key_wipe(&shared);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean bench_probe_cb(gpointer arg)
+{
+    BenchBurst *burst = arg;
+    burst->latency = g_get_monotonic_time() - burst->posted;
+    return G_SOURCE_REMOVE;
+}
+
+static void bench_dispatch(gboolean is_offloaded)
+{
+    DhtKey key;
+    dht_key_make_random(&key);
+    BenchBurst burst = {.client = dht_client_new(&key), .is_offloaded = is_offloaded};
+    DhtClientPrivate *priv = dht_client_get_instance_private(burst.client);
+
+    guint i;
+    for(i = 0; i < BENCH_PEERS; i++)
+    {
+        DhtKey peer;
+        dht_key_make_random(&peer);
+        dht_key_make_public(&burst.peers[i], &peer);
+    }
+
+    // Probe is queued behind the burst, its wait is the latency any other event would see
+    gint64 total = 0, max = 0;
+    for(i = 0; i < BENCH_BURSTS; i++)
+    {
+        burst.latency = -1;
+        burst.posted = g_get_monotonic_time();
+        g_idle_add(bench_burst_cb, &burst);
+        g_idle_add(bench_probe_cb, &burst);
+
+        while((burst.latency < 0) || (priv->num_handshakes > 0))
+            g_main_context_iteration(NULL, TRUE);
+
+        total += burst.latency;
+        max = MAX(max, burst.latency);
+    }
+
+    g_print("%-24s %10.1f us mean %8" G_GINT64_FORMAT " us max\n", is_offloaded ? "dispatch offloaded" : "dispatch inline",
+            (gdouble)total / BENCH_BURSTS, max);
+
+    g_object_unref(burst.client);
+}
+
+static void bench_shortlist(GRand *rand)
+{
+    DhtKey key;
+    dht_key_make_random(&key);
+    DhtClient *client = dht_client_new(&key);
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    // Offer more candidates than fit, so the tail is evicted as closer ones arrive
+    const guint count = 4 * DHT_SHORTLIST_COUNT;
+    DhtId target, *metrics = g_new(DhtId, count);
+    DhtAddress *addrs = g_new(DhtAddress, count);
+    bench_random(rand, &target, sizeof(target));
+    bench_random(rand, metrics, count * sizeof(DhtId));
+    bench_random(rand, addrs, count * sizeof(DhtAddress));
+
+    guint i, j, rounds = BENCH_ROUNDS / count;
+    BenchClock insert = {0};
+    for(i = 0; i < rounds; i++)
+    {
+        DhtLookup *lookup = dht_lookup_new(client, &target);
+
+        bench_resume(&insert);
+        for(j = 0; j < count; j++)
+            bench_sink += dht_lookup_insert(lookup, &metrics[j], &addrs[j]) != NULL;
+
+        bench_pause(&insert);
+        g_hash_table_remove(priv->lookup_table, &target);
+    }
+
+    bench_report("shortlist insert", &insert, (guint64)rounds * count);
+
+    g_free(addrs);
+    g_free(metrics);
+    g_object_unref(client);
+}
+
+static void bench_sequence(GRand *rand)
+{
+    // Candidate list replaced by the inline shortlist, a sliced query per candidate and no bound
+    const guint count = 4 * DHT_SHORTLIST_COUNT;
+    DhtId target, *metrics = g_new(DhtId, count);
+    DhtAddress *addrs = g_new(DhtAddress, count);
+    bench_random(rand, &target, sizeof(target));
+    bench_random(rand, metrics, count * sizeof(DhtId));
+    bench_random(rand, addrs, count * sizeof(DhtAddress));
+
+    guint i, j, rounds = BENCH_ROUNDS / count;
+    BenchClock insert = {0};
+    for(i = 0; i < rounds; i++)
+    {
+        GSequence *sequence = g_sequence_new(g_free);
+        GHashTable *table = g_hash_table_new(dht_address_hash, dht_address_equal);
+
+        bench_resume(&insert);
+        for(j = 0; j < count; j++)
+        {
+            if(g_hash_table_contains(table, &addrs[j]))
+                continue;
+
+            // Metric leads the query, so the ID comparison sorts it
+            BenchQuery *query = g_new(BenchQuery, 1);
+            query->metric = metrics[j];
+            query->addr = addrs[j];
+
+            GSequenceIter *iter = g_sequence_search(sequence, query, dht_id_compare, NULL);
+            g_hash_table_insert(table, &query->addr, g_sequence_insert_before(iter, query));
+        }
+
+        bench_pause(&insert);
+        g_hash_table_destroy(table);
+        g_sequence_free(sequence);
+    }
+
+    bench_report("sequence insert", &insert, (guint64)rounds * count);
+
+    g_free(addrs);
+    g_free(metrics);
+}
+
+int main(void)
+{
+    GRand *rand = g_rand_new_with_seed(1);
+
+    bench_xor(rand);
+    bench_table(rand, 1, DHT_NODE_COUNT);
+    bench_table(rand, 1, 20);
+    bench_table(rand, DHT_SYMBOL_BITS_MAX, DHT_NODE_COUNT);
+    bench_table(rand, DHT_SYMBOL_BITS_MAX, DHT_NODE_COUNT_MAX);
+    bench_request(rand);
+    bench_keys();
+    bench_dispatch(FALSE);
+    bench_dispatch(TRUE);
+    bench_shortlist(rand);
+    bench_sequence(rand);
+
+    g_rand_free(rand);
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2016 - Martin Jaros <xjaros32@stud.feec.vutbr.cz>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+// Routing tables and search are static, so the client is compiled into the simulation
+#include "dht-client.c"
+
+#define SIM_NODES 512 // default number of clients, each holds a socket
+#define SIM_LOOKUPS 4096 // lookups per configuration
+#define SIM_ALPHA 3 // queries per round
+#define SIM_ROUNDS_MAX 32 // rounds before a lookup counts as failed
+
+typedef struct _SimNetwork SimNetwork;
+typedef struct _SimEntry SimEntry;
+typedef guint (*SimSearchFunc)(DhtClient *client, const DhtId *id, MsgNode *nodes);
+
+struct _SimNetwork
+{
+    DhtClient **clients;
+    DhtId *ids;
+    guint num_clients, node_count;
+    SimSearchFunc search; // answers a lookup request on the responder's table
+};
+
+struct _SimEntry
+{
+    DhtId metric;
+    guint index;
+    gboolean is_queried;
+};
+
+static void sim_random(GRand *rand, gpointer data, gsize len)
+{
+    guint8 *ptr = data;
+    while(len--) *ptr++ = g_rand_int(rand);
+}
+
+static void sim_address(DhtAddress *addr, guint index)
+{
+    // Client index stands in for the IP address
+    memset(addr, 0, sizeof(DhtAddress));
+    memcpy(addr->data + 2, &index, sizeof(index));
+}
+
+static guint sim_index(const DhtAddress *addr)
+{
+    guint index;
+    memcpy(&index, addr->data + 2, sizeof(index));
+    return index;
+}
+
+static guint sim_walk_search(DhtClient *client, const DhtId *id, MsgNode *nodes)
+{
+    DhtClientPrivate *priv = dht_client_get_instance_private(client);
+
+    DhtId metric;
+    dht_id_xor(&metric, &priv->id, id);
+
+    // Bucket walk order of the search before exact selection, meaningful for one bit per step only
+    guint i, count = 0, nbits = 0, dir = 1;
+    while(nbits < priv->num_buckets)
+    {
+        const DhtBucket *bucket = &priv->buckets[nbits];
+        if(!(metric.data[nbits / 8] & (0x80 >> (nbits % 8))) == !dir)
+        {
+            for(i = 0; (i < bucket->num_nodes) && (count < priv->node_count); i++)
+            {
+                nodes[count].id = bucket->nodes[i].id;
+                nodes[count].addr = bucket->nodes[i].addr;
+                count++;
+            }
+
+            if(count == priv->node_count)
+                break;
+        }
+
+        if(dir)
+        {
+            if(nbits + 1 < priv->num_buckets) nbits++;
+            else dir = 0;
+        }
+        else
+        {
+            if(nbits == 0) break;
+            nbits--;
+        }
+    }
+
+    return count;
+}
+
+static SimNetwork* sim_network_new(guint num_clients, guint symbol_bits, guint node_count, SimSearchFunc search)
+{
+    SimNetwork *net = g_new0(SimNetwork, 1);
+    net->clients = g_new(DhtClient*, num_clients);
+    net->ids = g_new(DhtId, num_clients);
+    net->num_clients = num_clients;
+    net->node_count = node_count;
+    net->search = search;
+
+    // Same seed for every configuration, so they route over the same IDs
+    GRand *rand = g_rand_new_with_seed(1);
+    guint i, j;
+    for(i = 0; i < num_clients; i++)
+    {
+        DhtKey key;
+        sim_random(rand, &key, sizeof(key));
+        net->clients[i] = dht_client_new(&key);
+        g_object_set(net->clients[i], "symbol-bits", symbol_bits, "node-count", node_count, "replacement-count", 0, NULL);
+
+        DhtClientPrivate *priv = dht_client_get_instance_private(net->clients[i]);
+        net->ids[i] = priv->id;
+    }
+
+    // Every client is offered all others in its own random order, as a converged network would
+    guint *order = g_new(guint, num_clients);
+    for(i = 0; i < num_clients; i++)
+        order[i] = i;
+
+    for(i = 0; i < num_clients; i++)
+    {
+        for(j = num_clients - 1; j > 0; j--)
+        {
+            guint pick = g_rand_int_range(rand, 0, j + 1), tmp = order[j];
+            order[j] = order[pick];
+            order[pick] = tmp;
+        }
+
+        for(j = 0; j < num_clients; j++)
+        {
+            if(order[j] == i)
+                continue;
+
+            DhtAddress addr;
+            sim_address(&addr, order[j]);
+            dht_client_update(net->clients[i], &net->ids[order[j]], &addr, TRUE, 0);
+        }
+    }
+
+    g_free(order);
+    g_rand_free(rand);
+    return net;
+}
+
+static void sim_network_free(SimNetwork *net)
+{
+    guint i;
+    for(i = 0; i < net->num_clients; i++)
+        g_object_unref(net->clients[i]);
+
+    g_free(net->ids);
+    g_free(net->clients);
+    g_free(net);
+}
+
+static void sim_insert(SimEntry *entries, guint *count, const DhtId *target, const MsgNode *nodes, guint num_nodes)
+{
+    guint i, j;
+    for(i = 0; i < num_nodes; i++)
+    {
+        guint index = sim_index(&nodes[i].addr);
+        for(j = 0; (j < *count) && (entries[j].index != index); j++);
+        if(j < *count)
+            continue;
+
+        // Sorted insert, the farthest entry falls off a full shortlist
+        SimEntry entry = {.index = index, .is_queried = FALSE};
+        dht_id_xor(&entry.metric, &nodes[i].id, target);
+
+        guint pos = *count;
+        while((pos > 0) && (dht_id_compare(&entry.metric, &entries[pos - 1].metric, NULL) < 0))
+            pos--;
+
+        if(pos == DHT_SHORTLIST_COUNT)
+            continue;
+
+        if(*count < DHT_SHORTLIST_COUNT)
+            (*count)++;
+
+        memmove(&entries[pos + 1], &entries[pos], (*count - 1 - pos) * sizeof(SimEntry));
+        entries[pos] = entry;
+    }
+}
+
+static gint sim_lookup(SimNetwork *net, guint initiator, const DhtId *target, guint closest)
+{
+    SimEntry entries[DHT_SHORTLIST_COUNT];
+    MsgNode nodes[SIM_ALPHA][DHT_NODE_COUNT_MAX];
+    guint i, count = 0, lens[SIM_ALPHA];
+
+    lens[0] = net->search(net->clients[initiator], target, nodes[0]);
+    sim_insert(entries, &count, target, nodes[0], lens[0]);
+
+    // Rounds proceed in lockstep, hops are rounds until the closest node is known
+    gint hops;
+    for(hops = 0; hops < SIM_ROUNDS_MAX; hops++)
+    {
+        for(i = 0; i < count; i++)
+        {
+            if(entries[i].index == closest)
+                return hops;
+        }
+
+        guint sent = 0;
+        for(i = 0; (i < MIN(count, net->node_count)) && (sent < SIM_ALPHA); i++)
+        {
+            if(entries[i].is_queried)
+                continue;
+
+            entries[i].is_queried = TRUE;
+            lens[sent] = net->search(net->clients[entries[i].index], target, nodes[sent]);
+            sent++;
+        }
+
+        if(sent == 0)
+            break;
+
+        for(i = 0; i < sent; i++)
+            sim_insert(entries, &count, target, nodes[i], lens[i]);
+    }
+
+    return -1;
+}
+
+static gint sim_compare(gconstpointer a, gconstpointer b)
+{
+    return *(const gint*)a - *(const gint*)b;
+}
+
+static void sim_run(const gchar *name, guint num_clients, guint symbol_bits, guint node_count, SimSearchFunc search)
+{
+    SimNetwork *net = sim_network_new(num_clients, symbol_bits, node_count, search);
+    GRand *rand = g_rand_new_with_seed(2);
+
+    gint *hops = g_new(gint, SIM_LOOKUPS);
+    guint i, j, num_hops = 0, failed = 0, total = 0;
+    for(i = 0; i < SIM_LOOKUPS; i++)
+    {
+        DhtId target, metric, best;
+        sim_random(rand, &target, sizeof(target));
+
+        // Closest client by linear scan is the lookup's goal
+        guint closest = 0;
+        for(j = 0; j < num_clients; j++)
+        {
+            dht_id_xor(&metric, &net->ids[j], &target);
+            if((j == 0) || (dht_id_compare(&metric, &best, NULL) < 0))
+            {
+                best = metric;
+                closest = j;
+            }
+        }
+
+        guint initiator;
+        do initiator = g_rand_int_range(rand, 0, num_clients);
+        while(initiator == closest);
+
+        gint result = sim_lookup(net, initiator, &target, closest);
+        if(result < 0)
+        {
+            failed++;
+            continue;
+        }
+
+        hops[num_hops++] = result;
+        total += result;
+    }
+
+    qsort(hops, num_hops, sizeof(gint), sim_compare);
+    g_print("%-16s %6u nodes %6.2f mean hops %3d p99 hops %4u failed\n", name, num_clients,
+            num_hops ? (gdouble)total / num_hops : 0.0, num_hops ? hops[num_hops * 99 / 100] : 0, failed);
+
+    g_free(hops);
+    g_rand_free(rand);
+    sim_network_free(net);
+}
+
+int main(int argc, char *argv[])
+{
+    guint num_clients = (argc > 1) ? strtoul(argv[1], NULL, 10) : SIM_NODES;
+    if(num_clients < 2)
+    {
+        g_printerr("Usage: %s [clients]\n", argv[0]);
+        return 1;
+    }
+
+    // Same k throughout, so only the bits resolved per step and the result order differ
+    sim_run("walk b=1 k=16", num_clients, 1, DHT_NODE_COUNT, sim_walk_search);
+    sim_run("b=1 k=16", num_clients, 1, DHT_NODE_COUNT, dht_client_search);
+    sim_run("b=4 k=16", num_clients, DHT_SYMBOL_BITS_MAX, DHT_NODE_COUNT, dht_client_search);
+    sim_run("b=1 k=8", num_clients, 1, 8, dht_client_search);
+    sim_run("b=4 k=8", num_clients, DHT_SYMBOL_BITS_MAX, 8, dht_client_search);
+    return 0;
+}
@@ -44,6 +44,15 @@ nanotalk_proto.dissector = function(buffer, info, tree)
                 subtree:add(buffer(0, 1), "Type: Connection request (0xC2)")
                 subtree:add(buffer(1, 32), "Public key: " .. tostring(buffer(1, 32)))
                 subtree:add(buffer(33, 32), "Nonce: " .. tostring(buffer(33, 32)))
+            elseif buffer:len() == 81 then
+                info.cols.protocol = "NANOTALK"
+                info.cols.info = "Connection request with cookie"
+
+                local subtree = tree:add(nanotalk_proto, buffer())
+                subtree:add(buffer(0, 1), "Type: Connection request (0xC2)")
+                subtree:add(buffer(1, 32), "Public key: " .. tostring(buffer(1, 32)))
+                subtree:add(buffer(33, 32), "Nonce: " .. tostring(buffer(33, 32)))
+                subtree:add(buffer(65, 16), "Cookie: " .. tostring(buffer(65, 16)))
             end
         elseif msgtype == 0xC3 then
             if buffer:len() == 129 then
@@ -65,6 +74,16 @@ nanotalk_proto.dissector = function(buffer, info, tree)
                 subtree:add(buffer(1, 32), "Peer nonce: " .. tostring(buffer(1, 32)))
                 subtree:add(buffer(33, 32), "Authentication tag: " .. tostring(buffer(33, 32)))
             end
+        elseif msgtype == 0xC4 then
+            if buffer:len() == 49 then
+                info.cols.protocol = "NANOTALK"
+                info.cols.info = "Connection cookie"
+
+                local subtree = tree:add(nanotalk_proto, buffer())
+                subtree:add(buffer(0, 1), "Type: Connection cookie (0xC4)")
+                subtree:add(buffer(1, 32), "Peer nonce: " .. tostring(buffer(1, 32)))
+                subtree:add(buffer(33, 16), "Cookie: " .. tostring(buffer(33, 16)))
+            end
         end
     end
 end